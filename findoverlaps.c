@@ -18,10 +18,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <mpi.h>
 #include <omp.h>
 #include <ctype.h>
 #include <time.h>  // for info only
+#include <stdarg.h>
+#include <sched.h>
 
 #define _XOPEN_SOURCE 500
 #include <unistd.h>
@@ -38,7 +41,6 @@ ssize_t pread(int fd, void *buf, size_t count, off_t offset);
 #endif
 
 static FILE *overlaps = NULL;
-static FILE *read_file_sorted = NULL;
 static int memory_mapped = FALSE;
 static int trie_file_fd = -1;
 
@@ -48,12 +50,72 @@ typedef unsigned long long EDGE;
 typedef unsigned long long INDEX;
 #define ENDS_WORD (1ULL<<63ULL)
 #define EDGE_MASK (ENDS_WORD-1UL)
+#define TAIL_EDGE (1ULL<<62ULL) // points at a tail cell: the packed rest of a single read
 
 typedef struct cell {
   EDGE edge[5];
 } CELL;
 CELL *trie_cell;
 
+// maketrie can also be built with compact 32- or 40-bit edges (EDGE_BITS), in which
+// case the unused cell 0 of the -edges file starts with TRIE_MAGIC, the edge width in
+// bytes and the number of edges per cell.  We keep the cells in the file's own layout
+// in RAM (that is the point of the compact format) and unpack an edge at a time.
+// A trie with only 4 edges per cell keeps its N edges in <input>-nedges, a sorted
+// list of (parent, child) pairs which every node loads in full - there are few of them.
+#define TRIE_MAGIC "TRIE"
+static int edge_bytes = sizeof(EDGE), edge_ways = 5, cell_bytes = sizeof(CELL);
+static int tails; // maketrie was built with TAILS
+static unsigned long long *nedges;
+static long nedge_count;
+static INDEX local_base; // global index of our trie_cell[0]
+
+static EDGE nedge_lookup(INDEX idx)
+{
+  long lo = 0, hi = nedge_count-1, mid;
+
+  while (lo <= hi) {
+    mid = (lo+hi)/2;
+    if (nedges[mid*2] == (unsigned long long)idx) return nedges[mid*2+1];
+    if (nedges[mid*2] < (unsigned long long)idx) lo = mid+1; else hi = mid-1;
+  }
+  return 0LL;
+}
+
+static EDGE unpack_edge(const unsigned char *p)
+{
+  EDGE e;
+
+  if (edge_bytes == 8) {
+    memcpy(&e, p, sizeof(EDGE));
+    return e;
+  }
+  if (edge_bytes == 4) {
+    e = (EDGE)p[0] | ((EDGE)p[1] << 8) | ((EDGE)p[2] << 16) | ((EDGE)p[3] << 24);
+    if (e & (1ULL << 31)) return ENDS_WORD | (e & ((1ULL << 31)-1ULL));
+    if (tails && (e & (1ULL << 30))) return TAIL_EDGE | (e & ((1ULL << 30)-1ULL));
+    return e;
+  }
+  e = (EDGE)p[0] | ((EDGE)p[1] << 8) | ((EDGE)p[2] << 16) | ((EDGE)p[3] << 24) | ((EDGE)p[4] << 32);
+  if (e & (1ULL << 39)) return ENDS_WORD | (e & ((1ULL << 39)-1ULL));
+  if (tails && (e & (1ULL << 38))) return TAIL_EDGE | (e & ((1ULL << 38)-1ULL));
+  return e;
+}
+
+static EDGE trie_edge(INDEX idx, int c)
+{
+  if (c >= edge_ways) return nedge_lookup(idx + local_base);
+  if (cell_bytes == sizeof(CELL)) return trie_cell[idx].edge[c];
+  return unpack_edge((unsigned char *)trie_cell + idx*cell_bytes + c*edge_bytes);
+}
+
+// The same for a copy of cell idx (a global index) fetched from another rank.
+static EDGE cell_edge(const unsigned char *cell, INDEX idx, int c)
+{
+  if (c >= edge_ways) return nedge_lookup(idx);
+  return unpack_edge(cell + c*edge_bytes);
+}
+
 #define ROOT_CELL ((INDEX)1L)
 
 static INDEX last_used_edge = ROOT_CELL;
@@ -66,6 +128,29 @@ static INDEX last_used_edge = ROOT_CELL;
 
 char *trt = "ACGTN"; // translate table back from the above
 
+// A tail cell holds the read number in its first edge and then, edge_bytes*8-1 bits
+// per remaining edge, a base count followed by the bases at 2 bits each.
+static EDGE tail_cell(const unsigned char *cell, char *s)
+{
+  EDGE word[5];
+  int bits = edge_bytes*8-1, n = 0, i, b;
+
+  for (i = 0; i < edge_ways; i++) word[i] = unpack_edge(cell + i*edge_bytes) & EDGE_MASK;
+  for (b = 0; b < 8; b++) n |= ((word[1+b/bits] >> (b%bits)) & 1) << b;
+  for (i = 0; i < n; i++) {
+    int code = 0;
+    for (b = 8+2*i; b < 10+2*i; b++) code |= ((word[1+b/bits] >> (b%bits)) & 1) << (b&1);
+    s[i] = trt[code];
+  }
+  s[n] = '\0';
+  return word[0];
+}
+
+static EDGE tail_read(INDEX idx, char *s)
+{
+  return tail_cell((unsigned char *)trie_cell + idx*cell_bytes, s);
+}
+
 #define MAX_LINE 1024
 
 static int read_length = 0; // This is the length we found in the sorted-read file.
@@ -74,17 +159,95 @@ static int read_length = 0; // This is the length we found in the sorted-read fi
 #define CORES_PER_NODE 16ULL
 
 static int mpirank = 0, mpisize = 1, cluster_base = 0, cluster_size = 1;
+static int cluster_member = 0, cluster_index = 0, clusters = 1; // our place in our cluster, and which cluster
+static int threads = 1;
 
 static long long TASKS_PER_NODE, PROCESSORS_PER_NODE;
 
-#define TAG_DATA 1
-#define TAG_ACK 2
+// <input>-sorted, as written by maketrie: this header, then a record for each
+// unique read in sorted order.  A record is the read's original number (8
+// bytes), its bases 2 bits each with the first in the low bits, and a bit per
+// base that is set for an N.
+#define SORTED_MAGIC "SRT2"
+typedef struct {
+  char magic[4];
+  unsigned int read_length;
+  unsigned long long reads;
+  unsigned int record_bytes;
+  unsigned int spare[3];
+} SORTEDHEADER;
+#define SORTED_RECORD_BYTES(len) (8 + ((len) + 3) / 4 + ((len) + 7) / 8)
+
+static SORTEDHEADER sorted_header;
+static unsigned char *sorted_record; // sorted_record[i*sorted_header.record_bytes] is read sorted_first+i
+static long sorted_first, sorted_count; // this group's contiguous share of the reads
+static void *sorted_map;
+static size_t sorted_map_size;
+
+// Read the header of -sorted and map just the records that compute group
+// <group> of <groups> works on, so that each group reads 1/groups of the file.
+static void load_sorted(char *filename, int group, int groups)
+{
+  struct stat st;
+  off_t start, end, page_start;
+  int fd = open(filename, O_RDONLY);
+
+  if ((fd < 0) || (fstat(fd, &st) != 0)) {
+    fprintf(stderr, "findoverlaps[%d]: cannot open \"%s\" - %s\n", mpirank, filename, strerror(errno));
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  if ((pread(fd, &sorted_header, sizeof(SORTEDHEADER), 0) != sizeof(SORTEDHEADER))
+      || (memcmp(sorted_header.magic, SORTED_MAGIC, 4) != 0)
+      || (sorted_header.record_bytes != SORTED_RECORD_BYTES(sorted_header.read_length))
+      || (sorted_header.read_length >= MAX_LINE)
+      || (sizeof(SORTEDHEADER) + sorted_header.reads * sorted_header.record_bytes > st.st_size)) {
+    fprintf(stderr, "findoverlaps[%d]: \"%s\" is not a sorted read file from this version of maketrie\n",
+            mpirank, filename);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  sorted_first = sorted_header.reads * group / groups;
+  sorted_count = sorted_header.reads * (group + 1) / groups - sorted_first;
+  start = sizeof(SORTEDHEADER) + (off_t)sorted_first * sorted_header.record_bytes;
+  end = start + (off_t)sorted_count * sorted_header.record_bytes;
+  page_start = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+  sorted_map_size = end - page_start;
+  sorted_map = NULL; sorted_record = NULL;
+  if (sorted_count > 0) {
+    sorted_map = mmap(NULL, sorted_map_size, PROT_READ, MAP_SHARED, fd, page_start);
+    if (sorted_map == MAP_FAILED) {
+      fprintf(stderr, "findoverlaps[%d]: cannot map \"%s\" - %s\n", mpirank, filename, strerror(errno));
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    madvise(sorted_map, sorted_map_size, MADV_SEQUENTIAL);
+    sorted_record = (unsigned char *)sorted_map + (start - page_start);
+  }
+  close(fd);
+}
+
+// Unpack read sorted_first+i of -sorted into line, returning its original read number.
+static INDEX sorted_read(long i, char *line)
+{
+  unsigned char *r = sorted_record + i * sorted_header.record_bytes;
+  unsigned char *bases = r + 8, *n_mask = r + 8 + (read_length + 3) / 4;
+  unsigned long long original_read_number;
+  int j;
+
+  memcpy(&original_read_number, r, 8);
+  for (j = 0; j < read_length; j++) {
+    if (n_mask[j / 8] & (1 << (j % 8))) line[j] = 'N';
+    else line[j] = "ACGT"[(bases[j / 4] >> (2 * (j % 4))) & 3];
+  }
+  line[read_length] = '\0';
+  return original_read_number;
+}
 
-#define TAG_SEND_RAW_MEM 3
 #define TAG_EXIT_PROGRAM 6
 
-#define TAG_LOCATE_OVERLAPS 11
 #define TAG_PRINT_OVERLAPS 12
+#define TAG_HOPS 13
+#define TAG_COUNT 14
+#define TAG_COUNTED 15
 
 ssize_t retrying_pread(int filedes, void *buffer, size_t size, off_t offset)
 {
@@ -100,7 +263,206 @@ ssize_t retrying_pread(int filedes, void *buffer, size_t size, off_t offset)
   }
 }
 
-static long long CHUNKBITS, CHUNKSIZE, CHUNKMASK;
+// Big loads are split between all our threads, each reading its own part of the buffer
+// (which also puts the pages on its own NUMA node), after telling the kernel to read
+// ahead hard: one thread copying out of the page cache cannot keep up with a fast
+// disk.  Returns size, or -1 if any part failed.
+static long long load_bytes; // by this rank, and the time it took
+static double load_seconds;
+
+static ssize_t load_cells(int fd, void *buffer, size_t size, off_t offset)
+{
+  double start = MPI_Wtime();
+  int ok = TRUE;
+
+  posix_fadvise(fd, offset, (off_t)size, POSIX_FADV_SEQUENTIAL);
+#pragma omp parallel num_threads(threads) reduction(&&:ok)
+  {
+    int t = omp_get_thread_num(), n = omp_get_num_threads();
+    size_t first = size / n * t, last = (t == n-1) ? size : size / n * (t+1);
+
+    if (last > first) {
+      ok = (retrying_pread(fd, (char *)buffer + first, last - first, offset + (off_t)first)
+            == (ssize_t)(last - first));
+    }
+  }
+  load_bytes += size; load_seconds += MPI_Wtime() - start;
+  return ok ? (ssize_t)size : -1;
+}
+
+// -hugepages puts a rank's own copy of its chunk in huge pages, to cut the TLB misses
+// of a walk: from the pool set aside for MAP_HUGETLB if there is one, otherwise as
+// transparent huge pages.
+#define HUGE_PAGE_SIZE (2UL<<20)
+static int hugepages;
+static size_t hugepage_bytes; // what we mapped, if we did
+
+static void *allocate_cells(size_t size)
+{
+  void *p;
+
+  if (!hugepages) return malloc(size);
+  hugepage_bytes = (size + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+  p = mmap(NULL, hugepage_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) return p;
+  p = mmap(NULL, hugepage_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    hugepage_bytes = 0;
+    return malloc(size);
+  }
+  madvise(p, hugepage_bytes, MADV_HUGEPAGE);
+  return p;
+}
+
+static long long CHUNKSIZE; // the most cells this rank can hold
+
+// Member k of a cluster holds cells chunk_base[k] .. chunk_base[k+1]-1, as many as fit in
+// its memory, and the last takes whatever is left over.  With equal sized chunks the
+// member is found by division, otherwise by a binary search.
+static INDEX *chunk_base, chunk_uniform;
+
+static int chunk_of(INDEX idx)
+{
+  int lo = 0, hi = cluster_size-1;
+
+  if (chunk_uniform) return idx / chunk_uniform;
+  while (lo < hi) {
+    int mid = (lo+hi+1)/2;
+    if (chunk_base[mid] <= idx) lo = mid; else hi = mid-1;
+  }
+  return lo;
+}
+
+#define LOCAL(idx) ((idx) - local_base)
+
+// Ranks on the same host - the same member of several groups, say - share one copy of
+// the cells they hold between them, in memory from MPI_Win_allocate_shared, rather than
+// each loading its own.  The copy runs from the lowest cell any of them needs to the
+// highest, so it is only used when that is no bigger than their separate copies would
+// be together.  Each rank reads an equal slice of it from the file.  -private turns
+// this off.
+static MPI_Comm node_comm = MPI_COMM_NULL; // the ranks of all groups on this host
+static MPI_Win node_win;
+static int node_shared, private_chunks;
+
+static int load_shared_chunk(int fd)
+{
+  INDEX span[2], *spans, first, last, separate = 0;
+  MPI_Aint bytes, slice, end;
+  unsigned char *shared;
+  int node_ranks, node_rank, disp_unit, k;
+  ssize_t rc;
+
+  if (node_comm == MPI_COMM_NULL) return FALSE;
+  MPI_Comm_size(node_comm, &node_ranks);
+  MPI_Comm_rank(node_comm, &node_rank);
+  if (node_ranks == 1) return FALSE;
+
+  span[0] = local_base; span[1] = chunk_base[cluster_member+1];
+  spans = malloc(2 * node_ranks * sizeof(INDEX));
+  if (spans == NULL) return FALSE;
+  MPI_Allgather(span, 2, MPI_UNSIGNED_LONG_LONG, spans, 2, MPI_UNSIGNED_LONG_LONG, node_comm);
+  first = spans[0]; last = spans[1];
+  for (k = 0; k < node_ranks; k++) {
+    if (spans[2*k] < first) first = spans[2*k];
+    if (spans[2*k+1] > last) last = spans[2*k+1];
+    separate += spans[2*k+1] - spans[2*k];
+  }
+  free(spans);
+  if (last - first > separate) return FALSE; // (the same answer on every rank of the host)
+
+  bytes = (node_rank == 0) ? (MPI_Aint)((last - first) * cell_bytes) : 0;
+  MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, node_comm, &shared, &node_win);
+  MPI_Win_shared_query(node_win, 0, &bytes, &disp_unit, &shared);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, node_win);
+  slice = bytes / node_ranks * node_rank;
+  end = (node_rank == node_ranks-1) ? bytes : slice + bytes / node_ranks;
+  rc = load_cells(fd, shared + slice, (size_t)(end - slice), (off_t)(first * cell_bytes + slice));
+  if (rc != (ssize_t)(end - slice)) {
+    fprintf(stderr, "findoverlaps[%d]: failed to fetch %ld bytes of the shared trie from offset 0x%llx, rc = %ld\n",
+            mpirank, (long)(end - slice), (long long)(first * cell_bytes + slice), (long)rc);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  MPI_Win_sync(node_win);
+  MPI_Barrier(node_comm);
+  MPI_Win_sync(node_win);
+  MPI_Win_unlock_all(node_win);
+
+  trie_cell = (CELL *)(shared + (local_base - first) * cell_bytes);
+  node_shared = TRUE;
+  if (node_rank == 0) {
+    fprintf(stderr, "Node %d: %d ranks on this host share %lld cells, where they would hold %lld separately\n",
+            mpirank, node_ranks, (long long)(last - first), (long long)separate);
+  }
+  return TRUE;
+}
+
+// With -rma the other ranks of a group expose their chunks of the trie as an MPI window,
+// and the base rank follows searches into them itself, fetching the cells it needs with
+// MPI_Get, rather than passing the searches on for the other ranks to carry out.
+static int rma;
+static MPI_Comm work_comm;  // every rank holding part of a trie, numbered as in MPI_COMM_WORLD
+static MPI_Win trie_win;
+static long long rma_fetches, rma_rounds; // cells fetched, and the round trips they took
+static double rma_wait;                   // time spent on those round trips
+
+static void rma_get(INDEX idx, unsigned char *cell) // (within critical(mpi))
+{
+  int member = chunk_of(idx);
+
+  MPI_Get(cell, cell_bytes, MPI_BYTE, cluster_base+member, (MPI_Aint)((idx - chunk_base[member])*cell_bytes),
+          cell_bytes, MPI_BYTE, trie_win);
+}
+
+#ifdef AMOS_OVERLAPS
+// Cell idx (a global index), from our own chunk or fetched into 'cell'.
+static const unsigned char *node_cell(INDEX idx, unsigned char *cell)
+{
+  double start;
+
+  if (chunk_of(idx) == cluster_member) return (unsigned char *)trie_cell + LOCAL(idx)*cell_bytes;
+  start = MPI_Wtime();
+#pragma omp critical (mpi)
+  {
+    rma_get(idx, cell);
+    MPI_Win_flush_local(cluster_base+chunk_of(idx), trie_win);
+  }
+#pragma omp critical (rma)
+  {
+    rma_fetches++; rma_rounds++; rma_wait += MPI_Wtime() - start;
+  }
+  return cell;
+}
+#endif
+
+// -cache=N has the base rank copy up to N cells from the other ranks of its group before
+// the search starts: those just past the edges that leave our chunk, which every search
+// that leaves it has to pass through.  A search that reaches one carries on here rather than
+// being passed on, until it needs a cell we don't have.  The trie never changes, so
+// once filled the cache is only ever read, and the threads share it without locks.
+static long long cache_cells, cache_held; // wanted, and copied
+static int cache_shift;             // the table has 1<<cache_shift slots, at least 2N
+static INDEX *cache_key;            // cell held in each slot, or 0 for none
+static unsigned int *cache_at;      // and where in cache_cell it is
+static unsigned char *cache_cell;
+static long long cache_hits, cache_finished; // cells found in it, searches that ended in it
+
+#define CACHE_SLOT(idx) ((unsigned long)(((idx) * 0x9E3779B97F4A7C15ULL) >> (64 - cache_shift)))
+
+static const unsigned char *cached_cell(INDEX idx)
+{
+  unsigned long slot, mask;
+
+  if (cache_key == NULL) return NULL;
+  mask = (1UL << cache_shift) - 1UL;
+  for (slot = CACHE_SLOT(idx); cache_key[slot] != 0; slot = (slot+1) & mask) {
+    if (cache_key[slot] == idx) return cache_cell + (size_t)cache_at[slot]*cell_bytes;
+  }
+  return NULL;
+}
+
+static char *walk_cells(const unsigned char *cell, char *s, EDGE *edge, long read_number, int matching_offset);
+static void rma_queue(char *s, EDGE edge, long read_number, int matching_offset);
 
 static void shut_down_other_nodes(void) // within this cluster-group
 {
@@ -111,8 +473,8 @@ static void shut_down_other_nodes(void) // within this cluster-group
   for (target_rank = cluster_base+1; target_rank < cluster_base+cluster_size; target_rank++) {
     if (target_rank != mpirank) { // normally called only by cluster_base except if error
       MPI_Send(&value,/* message buffer - data part and trigger to perform operation */
-	   1,/* one data item */
-	   MPI_LONG,/* data value is a long integer */
+	   sizeof(value),/* received as bytes, like every request */
+	   MPI_BYTE,
 	   target_rank,/* destination process rank */
 	   TAG_EXIT_PROGRAM, // The command.
 	   MPI_COMM_WORLD);/* always use this */
@@ -130,8 +492,38 @@ static void shut_down_other_nodes(void) // within this cluster-group
   }
 }
 
-static void send_bytes(int dest, void *memp, long bytes) { // just a type-checked macro
-  MPI_Send(memp, bytes, MPI_BYTE, dest, TAG_SEND_RAW_MEM, MPI_COMM_WORLD);
+// Each thread collects its overlaps in its own buffer, which goes into our .ovl file
+// in large pieces, so threads neither interleave within a line nor contend for the
+// file on every line.
+#define OUTBUF_SIZE (1<<20)
+typedef struct {
+  char *text;
+  size_t used;
+} OUTBUF;
+static OUTBUF *outbuf; // one per thread
+
+static void flush_overlaps(OUTBUF *b)
+{
+  if (b->used == 0) return;
+#pragma omp critical (ovl)
+  {
+    if (fwrite(b->text, 1, b->used, overlaps) != b->used) {
+      fprintf(stderr, "\n\n************* print_overlaps() failed, %s\n", strerror(errno));
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  b->used = 0;
+}
+
+static void print_overlap_record(const char *format, ...)
+{
+  OUTBUF *b = &outbuf[omp_get_thread_num()];
+  va_list ap;
+
+  if (OUTBUF_SIZE - b->used < 256) flush_overlaps(b); // a record is well under 256 bytes
+  va_start(ap, format);
+  b->used += vsnprintf(b->text + b->used, OUTBUF_SIZE - b->used, format, ap);
+  va_end(ap);
 }
 
 static void locate_overlaps(char *s, EDGE edge, long read_number, int matching_offset);
@@ -142,6 +534,18 @@ static void local_locate_overlaps(char *s, EDGE edge, long read_number, int matc
 
   for (;;) {
     //fprintf(stderr, "locate_overlaps(\"%s\", %llx, %ld, %d)\n", s, edge, read_number, matching_offset);
+    if (edge & TAIL_EDGE) { // only one read below here, and its tail is in our chunk
+      char tail[256];
+      int i, print_count = 0;
+
+      tail_read(LOCAL(edge & ~TAIL_EDGE), tail);
+      for (i = 0; (s[i] != '\0') && (s[i] != '\n') && (s[i] != '\r'); i++) {
+        if (s[i] != tail[i]) return;
+      }
+      print_overlaps(edge, read_number, matching_offset, &print_count);
+      return;
+    }
+
     c = *s++;
 
     if (c == 'A') c = _A_; // architecture-dependent whether this or a lookup table is faster..
@@ -150,11 +554,20 @@ static void local_locate_overlaps(char *s, EDGE edge, long read_number, int matc
     else if (c == 'T') c = _T_;
     else c = _N_; // some other char
 
-    edge = trie_cell[edge&CHUNKMASK].edge[c] & EDGE_MASK;
+    edge = trie_edge(LOCAL(edge), c) & EDGE_MASK;
     if (edge == 0LL) return; // no matches down this path
 
-    // edge may now be stored on a different processor so do *NOT* access trie_cell[edge&CHUNKMASK]
-    //  except with a 'safe' procedure
+    // edge may now be stored on a different processor so do *NOT* access trie_cell[LOCAL(edge)]
+    //  except with a 'safe' procedure.  (A tail is normally with its parent, but our chunks
+    //  need not start where maketrie's did.)
+
+    if (edge & TAIL_EDGE) {
+      if (chunk_of(edge & ~TAIL_EDGE) != cluster_member) {
+        locate_overlaps(/* modified */ s, edge, read_number, matching_offset);
+        return;
+      }
+      continue;
+    }
   
     if ((*s == '\0') || (*s == '\n') || (*s == '\r')) {
       int print_count = 0;
@@ -165,7 +578,7 @@ static void local_locate_overlaps(char *s, EDGE edge, long read_number, int matc
 
     //fprintf(stderr, "recurse: locate_overlaps(\"%s\", %llx, %ld, %d)\n", s, edge, read_number,
     //        matching_offset);
-    if ((edge >> CHUNKBITS) != (mpirank%cluster_size)) {
+    if (chunk_of(edge) != cluster_member) {
       locate_overlaps(/* modified */ s, edge, read_number, matching_offset);
       return;
     } // else optimise tail recursion by going round the loop again.
@@ -175,35 +588,46 @@ static void local_locate_overlaps(char *s, EDGE edge, long read_number, int matc
 #ifdef AMOS_OVERLAPS
 static void local_print_overlaps(EDGE edge, long read_number, int matching_offset, int *number_printed)
 {
+  unsigned char fetched[sizeof(CELL)];
+  const unsigned char *cell = NULL; // unless it is another rank's
   int i;
 
+  if (chunk_of(edge & ~TAIL_EDGE) != cluster_member) {
+    cell = cached_cell(edge & ~TAIL_EDGE);
+    if (cell != NULL) {
+#pragma omp atomic
+      cache_hits++;
+    } else cell = node_cell(edge & ~TAIL_EDGE, fetched);
+  }
+
   //fprintf(stderr, "Node %d: print_overlaps(%lld, %ld, %d, %d)\n", mpirank, edge, read_number,
   //        matching_offset, *number_printed);
 
   for (i = 0; i < 5; i++) {
     if ((*number_printed) >= MAX_OVERLAPS) return; // Enough!
-    if (trie_cell[edge & CHUNKMASK].edge[i]&ENDS_WORD) {
+    EDGE e;
+    if (edge & TAIL_EDGE) { // a single read
+      char tail[256];
+      if (i > 0) e = 0LL;
+      else e = ENDS_WORD | ((cell != NULL) ? tail_cell(cell, tail) : tail_read(LOCAL(edge & ~TAIL_EDGE), tail));
+    } else e = (cell != NULL) ? cell_edge(cell, edge, i) : trie_edge(LOCAL(edge), i);
+
+    if (e&ENDS_WORD) {
       // Do we want to include self-overlaps?
-      // i.e. where trie_cell[edge & CHUNKMASK].edge[i]&EDGE_MASK == read_number ???
-      fprintf(overlaps, "{OVL\nadj:N\nrds:%ld,%lld\nscr:0\nahg:%d\nbhg:%d\n}\n",
+      // i.e. where trie_cell[LOCAL(edge)].edge[i]&EDGE_MASK == read_number ???
+      print_overlap_record("{OVL\nadj:N\nrds:%ld,%lld\nscr:0\nahg:%d\nbhg:%d\n}\n",
               1+read_number, // Hopefully I have these two in the right order now...
-              1+(trie_cell[edge & CHUNKMASK].edge[i]&EDGE_MASK),
+              1+(e&EDGE_MASK),
               matching_offset, matching_offset);
               // NOTE: I've been numbering reads from 0 up like a computer scientist should;
               // apparently bioinformaticists count from 1 up like engineers do :-(  Hence "+1" above.
       *number_printed = (1 + (*number_printed));
       // should we warn if we're truncating excessive overlaps?
-      if (ferror(overlaps)) {
-        fprintf(stderr, "\n\n************* print_overlaps() failed, %s\n", strerror(errno));
-        shut_down_other_nodes();
-        MPI_Finalize();
-        exit(EXIT_FAILURE);
-      }
-    } else if (trie_cell[edge & CHUNKMASK].edge[i]) {
+    } else if (e) {
       // not final letter, and this letter is present with more to follow
       // recurse, *safely*, to locate all leaf nodes
       if ((*number_printed) < MAX_OVERLAPS) {
-        print_overlaps(trie_cell[edge & CHUNKMASK].edge[i], read_number, matching_offset,
+        print_overlaps(e, read_number, matching_offset,
                        number_printed);
       }
     }
@@ -211,196 +635,373 @@ static void local_print_overlaps(EDGE edge, long read_number, int matching_offse
 }
 #endif
 
-static int remote_locate_overlaps(long target_rank, char *s, long edge,
-                                  long read_number, int matching_offset)
-{  // pass to another node
-  MPI_Status status;
-  long value = 0L; // generic up-front parameter
-  long stringlength;
+static long long remote_hops; // overlap searches handed on to another rank, from this one
+static MPI_Comm reply_comm;   // replies to remote calls travel apart from the requests
 
-//#pragma omp critical
-  {
-  stringlength = strlen(s)+1;
-
-  // COMMAND CODE
-  //fprintf(stderr, "sending TAG_LOCATE_OVERLAPS\n");
-  MPI_Send(&value,/* message buffer - data part and trigger to perform operation */
-	   1,/* one data item */
-	   MPI_LONG,/* data value is a long integer */
-	   target_rank,/* destination process rank */
-	   TAG_LOCATE_OVERLAPS,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
-
-  // SEND PARAMETERS - later optimise by sending one param via 'value' above
-  //fprintf(stderr, "sending stringlength=%ld\n", stringlength);
-  MPI_Send(&stringlength,/* message buffer - address part */
-	   1,/* one data item */
-	   MPI_LONG,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
-
-  //fprintf(stderr, "Sending string %s\n", s);
-  send_bytes(target_rank, s, stringlength);
-
-  //fprintf(stderr, "sending edge %llx\n", edge);
-  MPI_Send(&edge,
-	   1,/* one data item */
-	   MPI_LONG,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
-
-  MPI_Send(&read_number,
-	   1,/* one data item */
-	   MPI_LONG,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
-
-  MPI_Send(&matching_offset,
-	   1,/* one data item */
-	   MPI_INT,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
+#ifdef AMOS_OVERLAPS
+// Printing the overlaps below a node held by another rank is still a remote call, as the
+// walk needs the count printed so far back to know when to stop.  The request is a
+// single message, and the reply, a long, comes back on reply_comm tagged with the
+// caller's thread number, so that calls from different threads are never mixed up.
+typedef struct {
+  long value;               // generic up-front parameter
+  long read_number;
+  EDGE edge;
+  int matching_offset;
+  int reply_tag;
+} RPC_HEADER;
 
-  // Get acknowlegement that it has been written (to synchronise)
-  MPI_Recv(&value,/* message buffer - used for len function result */
-	   1,/* one data item */
-	   MPI_LONG,/* response is a long int for now (temp) */
-	   MPI_ANY_SOURCE,/* receive from any sender */
-	   MPI_ANY_TAG,/* receive any type of message */
-	   MPI_COMM_WORLD,/* always use this */
-	   &status);/* info about received message */
-}
-  // If len were not needed we could fire & forget, by removing the Recv above...
-  return (int)value;
+// MPI calls are serialised between our threads (MPI_THREAD_SERIALIZED), so nothing may
+// block inside critical(mpi) waiting for another rank: post the receive for the reply,
+// send the request, and then poll for the reply.
+static long call_rpc(long target_rank, int tag, RPC_HEADER *header)
+{
+  MPI_Request pending;
+  long reply = 0L;
+  int done = FALSE;
 
+  header->reply_tag = omp_get_thread_num();
+#pragma omp critical (mpi)
+  {
+    MPI_Irecv(&reply, 1, MPI_LONG, target_rank, header->reply_tag, reply_comm, &pending);
+    MPI_Send(header, sizeof(RPC_HEADER), MPI_BYTE, target_rank, tag, MPI_COMM_WORLD);
+  }
+  for (;;) {
+#pragma omp critical (mpi)
+    MPI_Test(&pending, &done, MPI_STATUS_IGNORE);
+    if (done) return reply;
+    sched_yield();
+  }
 }
 
-#ifdef AMOS_OVERLAPS
 static int remote_print_overlaps(long target_rank, long edge, long read_number,
                                  int matching_offset, int *number_printed)
 { // pass to another node
-  MPI_Status status;
-  long value = 0L; // generic up-front parameter
-
-//#pragma omp critical
-  {
-  // COMMAND CODE
-  value = (long) *number_printed;
-  MPI_Send(&value,/* message buffer - data part and trigger to perform operation */
-	   1,/* one data item */
-	   MPI_LONG,/* data value is a long integer */
-	   target_rank,/* destination process rank */
-	   TAG_PRINT_OVERLAPS,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
+  RPC_HEADER header;
 
-  // SEND PARAMETERS - later optimise by sending one param via 'value' above
-
-  MPI_Send(&edge,
-	   1,/* one data item */
-	   MPI_LONG,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
+  header.value = (long)*number_printed; header.edge = edge;
+  header.read_number = read_number; header.matching_offset = matching_offset;
+  *number_printed = (int)call_rpc(target_rank, TAG_PRINT_OVERLAPS, &header);
+  return *number_printed;
+}
 
-  MPI_Send(&read_number,
-	   1,/* one data item */
-	   MPI_LONG,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
+static void accept_print_overlaps(int caller, RPC_HEADER *header)
+{ // receive request from RPC mechanism
+  int number_printed = (int)header->value;
+  long value;
 
-  MPI_Send(&matching_offset,
-	   1,/* one data item */
-	   MPI_INT,/* index is a long long integer */
-	   target_rank,/* destination process rank */
-	   TAG_DATA,/* user chosen message tag */
-	   MPI_COMM_WORLD);/* always use this */
-
-  // Get acknowlegement that it has been written (to synchronise)
-  MPI_Recv(&value,/* message buffer - used for len function result */
-	   1,/* one data item */
-	   MPI_LONG,/* response is a long int for now (temp) */
-	   MPI_ANY_SOURCE,/* receive from any sender */
-	   MPI_ANY_TAG,/* receive any type of message */
-	   MPI_COMM_WORLD,/* always use this */
-	   &status);/* info about received message */
-  *number_printed = (int)value;
-  }
-  return (int)value;
+  print_overlaps(header->edge, header->read_number, header->matching_offset, &number_printed);
 
+  // Acknowlege and return result
+  value = (long)number_printed;
+#pragma omp critical (mpi)
+  MPI_Send(&value, 1, MPI_LONG, caller, header->reply_tag, reply_comm);
 }
 #endif
 
-static void accept_locate_overlaps(int myrank, long value, MPI_Status status)
-{ // receive request from RPC mechanism
-  char s[MAX_LINE];
+// A search that runs off the end of our chunk is not a remote call: it is passed on,
+// with everything needed to carry on from where it stopped, to the rank holding the next
+// node, and nobody waits for it.  That rank prints whatever it finds itself, and passes
+// the search on again if it has to.  Each thread collects the searches it passes on
+// into a batch per destination, which is sent when it fills up or when the thread runs
+// out of work, and the sender goes straight on with its own work.  So there is no reply
+// to tell us when everything is finished; instead the base rank counts (see
+// run_network()).
+typedef struct {
   EDGE edge;
-  long read_number, stringlength;
+  long read_number;
   int matching_offset;
-  int caller;
+  int length;               // of the string which follows, NUL-terminated and padded to 8 bytes
+} HOP;
+#define HOP_BYTES(length) (sizeof(HOP) + (((length)+8) & ~7))
+#define HOP_BATCH_BYTES (16*1024)
+
+typedef struct batch {
+  struct batch *next;       // on the sending thread's list until MPI has finished with it
+  char data[HOP_BATCH_BYTES];
+  MPI_Request request;
+} BATCH;
+typedef struct {
+  BATCH *batch;
+  int used;
+} OUTBOX;
+static OUTBOX *outbox;      // [thread*cluster_size + member]
+static BATCH **in_transit;  // per thread
+static long long hops_sent, hops_done; // by this rank, for detecting termination
+
+static void reap_batches(int thread, int wait)
+{
+  for (;;) {
+    BATCH **p = &in_transit[thread], *b;
 
-  // RECEIVE PARAMETERS (possible optional first parameter passed in as 'value')
-  //fprintf(stderr, "Receiving stringlen\n");
-  MPI_Recv(&stringlength, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-  //fprintf(stderr, "Received stringlen=%ld\n", stringlength);
-  caller = status.MPI_SOURCE;
+    while ((b = *p) != NULL) {
+      int done;
 
-  //fprintf(stderr, "Receiving string\n");
-  MPI_Recv(s, stringlength, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-  //fprintf(stderr, "Received string=%s\n", s);
+#pragma omp critical (mpi)
+      MPI_Test(&b->request, &done, MPI_STATUS_IGNORE);
+      if (done) {
+        *p = b->next; free(b);
+      } else p = &b->next;
+    }
+    if (!wait || (in_transit[thread] == NULL)) return;
+    sched_yield();
+  }
+}
 
-  MPI_Recv(&edge, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-  //fprintf(stderr, "received  edge %llx\n", edge);
+static void send_hops(int thread, int member)
+{
+  OUTBOX *o = &outbox[thread*cluster_size + member];
+  BATCH *b = o->batch;
+
+  if (o->used == 0) return;
+#pragma omp critical (mpi)
+  MPI_Isend(b->data, o->used, MPI_BYTE, cluster_base+member, TAG_HOPS, MPI_COMM_WORLD, &b->request);
+  b->next = in_transit[thread]; in_transit[thread] = b;
+  o->batch = NULL; o->used = 0;
+}
 
-  MPI_Recv(&read_number, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+static void flush_hops(int thread) // when we have nothing better to do
+{
+  int member;
 
-  MPI_Recv(&matching_offset, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+  for (member = 0; member < cluster_size; member++) send_hops(thread, member);
+  reap_batches(thread, FALSE);
+}
 
-  locate_overlaps(s, edge, read_number, matching_offset);
+static void forward_hop(int member, char *s, EDGE edge, long read_number, int matching_offset)
+{
+  int thread = omp_get_thread_num(), length = strlen(s);
+  OUTBOX *o = &outbox[thread*cluster_size + member];
+  HOP *h;
 
-  MPI_Send(&value, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD); // Acknowlege and return result
+  if ((o->batch != NULL) && (o->used + HOP_BYTES(length) > HOP_BATCH_BYTES)) {
+    send_hops(thread, member);
+    reap_batches(thread, FALSE);
+  }
+  if (o->batch == NULL) {
+    o->batch = malloc(sizeof(BATCH));
+    if (o->batch == NULL) {
+      fprintf(stderr, "findoverlaps[%d]: out of memory for searches to pass on\n", mpirank);
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+  h = (HOP *)(o->batch->data + o->used);
+  h->edge = edge; h->read_number = read_number;
+  h->matching_offset = matching_offset; h->length = length;
+  memcpy((char *)(h+1), s, length+1);
+  o->used += HOP_BYTES(length);
+#pragma omp atomic
+  hops_sent++;
+}
+
+static void run_hops(char *data, int bytes)
+{
+  long long n = 0;
+  int used;
 
+  for (used = 0; used < bytes; used += HOP_BYTES(((HOP *)(data+used))->length)) {
+    HOP *h = (HOP *)(data+used);
+
+    locate_overlaps((char *)(h+1), h->edge, h->read_number, h->matching_offset);
+    n++;
+  }
+  // Counted only now, after any searches these led to have been counted as sent.
+#pragma omp atomic
+  hops_done += n;
 }
 
-static void accept_print_overlaps(int myrank, long value, MPI_Status status)
-{ // receive request from RPC mechanism
-  EDGE edge;
-  long read_number;
-  int matching_offset;
-  int number_printed = 0;
-  int caller;
+// Thread 0 of each rank of a group takes messages off the network and queues them, and
+// the other threads carry them out - on the base rank, once they have finished their
+// share of the reads.  A rank with only one thread (which it will have if MPI cannot
+// support more) carries out each message itself as it arrives.
+typedef struct task {
+  struct task *next;
+  long bytes;
+  int tag, caller;
+  char data[1];
+} TASK;
+static TASK *task_head, *task_tail;
+static int serving, workers_running;
+static omp_lock_t task_lock;
+
+static void dispatch(TASK *t)
+{
+  if (t->tag == TAG_HOPS) {  // CALL locate_overlaps() for each
+    run_hops(t->data, (int)t->bytes);
 
-  // RECEIVE PARAMETERS (possible optional first parameter passed in as 'value')
-  caller = status.MPI_SOURCE;
-  number_printed = (int)value;
+#ifdef AMOS_OVERLAPS
+  } else if (t->tag == TAG_PRINT_OVERLAPS) {  // CALL print_overlaps()
+    accept_print_overlaps(t->caller, (RPC_HEADER *)t->data);
+#endif
 
-  MPI_Recv(&edge, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+  } else {
+    // UNKNOWN - CODING ERROR?
+  }
+  free(t);
+}
 
-  MPI_Recv(&read_number, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+static void handle_requests(void) // the other threads
+{
+  int thread = omp_get_thread_num();
 
-  MPI_Recv(&matching_offset, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+  for (;;) {
+    TASK *t;
+    int open;
+
+#pragma omp atomic read
+    open = serving;
+    omp_set_lock(&task_lock);
+    t = task_head;
+    if (t) {
+      task_head = t->next;
+      if (task_head == NULL) task_tail = NULL;
+    }
+    omp_unset_lock(&task_lock);
+    if (t == NULL) {
+      flush_hops(thread);
+      if (!open) break; // (checked before the queue, so nothing can still arrive)
+      sched_yield();
+      continue;
+    }
+    dispatch(t);
+  }
+  reap_batches(thread, TRUE);
+}
 
-  print_overlaps(edge, read_number, matching_offset, &number_printed);
+static void count_reply(int caller) // our part of a termination wave
+{
+  long long count[2];
+
+#pragma omp atomic read
+  count[0] = hops_sent;
+#pragma omp atomic read
+  count[1] = hops_done;
+#pragma omp critical (mpi)
+  MPI_Send(count, sizeof(count), MPI_BYTE, caller, TAG_COUNTED, MPI_COMM_WORLD);
+}
 
-  // Acknowlege and return result
-  value=(long)number_printed; MPI_Send(&value, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+// The network thread.  Once the base rank's own reads are done, it asks every rank of
+// the group how many searches it has passed on and how many it has carried out.  The
+// counts only go up, so if two waves of asking in a row find the same totals, with as
+// many carried out as passed on, then nothing was in flight in between and nothing
+// more can happen.  The base rank then tells the others to exit.
+static void run_network(void)
+{
+  long long sent = 0, done = 0, last_sent = -1, last_done = -1;
+  int replies = -1; // still to come in the current wave, or -1 if there is none
+
+  for (;;) {
+    MPI_Status status;
+    TASK *t = NULL;
+    int flag, bytes = 0, running, k;
+
+#pragma omp critical (mpi)
+    {
+      MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+      if (flag) {
+        MPI_Get_count(&status, MPI_BYTE, &bytes);
+        t = malloc(sizeof(TASK) + bytes);
+        if (t != NULL) {
+          MPI_Recv(t->data, bytes, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG,
+                   MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+      }
+    }
+    if (flag) {
+      if (t == NULL) {
+        fprintf(stderr, "findoverlaps[%d]: out of memory for incoming requests\n", mpirank);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      t->next = NULL; t->bytes = bytes; t->tag = status.MPI_TAG; t->caller = status.MPI_SOURCE;
+      if (t->tag == TAG_EXIT_PROGRAM) {  // Kill clients
+        //fprintf(stderr, "Node %d asked to exit\n", mpirank);
+        free(t);
+        break;
+      } else if (t->tag == TAG_COUNT) {
+        count_reply(t->caller);
+        free(t);
+      } else if (t->tag == TAG_COUNTED) {
+        sent += ((long long *)t->data)[0]; done += ((long long *)t->data)[1];
+        replies--;
+        free(t);
+      } else if (threads == 1) {
+        dispatch(t);
+      } else {
+        omp_set_lock(&task_lock);
+        if (task_tail) task_tail->next = t; else task_head = t;
+        task_tail = t;
+        omp_unset_lock(&task_lock);
+      }
+      continue;
+    }
+
+#pragma omp atomic read
+    running = workers_running;
+    if ((cluster_member == 0) && (running == 0) && (replies <= 0)) {
+      if (replies == 0) { // a wave has just finished
+        if ((sent == done) && (sent == last_sent) && (done == last_done)) break;
+        last_sent = sent; last_done = done;
+      }
+#pragma omp atomic read
+      sent = hops_sent;
+#pragma omp atomic read
+      done = hops_done;
+      for (k = cluster_base+1; k < cluster_base+cluster_size; k++) {
+#pragma omp critical (mpi)
+        MPI_Send(&sent, 0, MPI_BYTE, k, TAG_COUNT, MPI_COMM_WORLD);
+      }
+      replies = cluster_size-1;
+      continue;
+    }
+    if (threads == 1) {
+      flush_hops(0);
+      if (cluster_member != 0) { // only the base rank has anything to do unasked
+        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        continue;
+      }
+    }
+    sched_yield();
+  }
+#pragma omp atomic write
+  serving = FALSE;
+  if (threads == 1) reap_batches(0, TRUE);
+}
 
+static void start_network(void)
+{
+  outbox = calloc(threads*cluster_size, sizeof(OUTBOX));
+  in_transit = calloc(threads, sizeof(BATCH *));
+  if ((outbox == NULL) || (in_transit == NULL)) {
+    fprintf(stderr, "findoverlaps[%d]: cannot allocate the outgoing batches\n", mpirank);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  serving = TRUE;
+  omp_init_lock(&task_lock);
 }
 
 static void locate_overlaps(char *s, EDGE edge, long read_number, int matching_offset)
 {
-  long long int target_rank = (long long)edge >> CHUNKBITS;
+  long long int target_rank = chunk_of(edge & ~TAIL_EDGE);
+  const unsigned char *cell;
 
   //fprintf(stderr, "locate_overlaps(\"%s\", %llx)  target_rank=%lld  mpirank=%d\n", s,
   //        edge, target_rank, mpirank);
-  if (target_rank == (mpirank%cluster_size)) {
+  if (target_rank == cluster_member) {
     local_locate_overlaps(s, edge, read_number, matching_offset);
+  } else if ((cell = cached_cell(edge & ~TAIL_EDGE)) != NULL) {
+#pragma omp atomic
+    cache_hits++;
+    s = walk_cells(cell, s, &edge, read_number, matching_offset);
+    if (s != NULL) locate_overlaps(s, edge, read_number, matching_offset); // (not cached)
+    else {
+#pragma omp atomic
+      cache_finished++;
+    }
   } else {
-    remote_locate_overlaps((long)(target_rank+cluster_base), s, edge, read_number, matching_offset);
+#pragma omp atomic
+    remote_hops++;
+    if (rma) rma_queue(s, edge, read_number, matching_offset);
+    else forward_hop((int)target_rank, s, edge, read_number, matching_offset);
   }
 
   return;
@@ -415,10 +1016,10 @@ static void print_overlaps(EDGE edge, long read_number, int matching_offset,
   // and output actual overlaps, eg AMOS "OVL" records.
 
 #ifdef AMOS_OVERLAPS
-  long long int target_rank = (long long)edge >> CHUNKBITS;
+  long long int target_rank = chunk_of(edge & ~TAIL_EDGE);
 
   // A tree-walk is necessary to find the leaves
-  if (target_rank == (mpirank%cluster_size)) {
+  if ((target_rank == cluster_member) || rma || (cached_cell(edge & ~TAIL_EDGE) != NULL)) {
     local_print_overlaps(edge, read_number, matching_offset, number_printed);
   } else {
     remote_print_overlaps(target_rank+cluster_base, edge, read_number, matching_offset, number_printed);
@@ -429,11 +1030,472 @@ static void print_overlaps(EDGE edge, long read_number, int matching_offset,
   // There is no need to heed "MIN_OVERLAP" or "MAX_OVERLAPS" when all we're printing
   // is one node for all overlaps of a certain length.  Those tweaks are only useful
   // when we walk the trie at this node and generate a large list of actual overlaps.
-  fprintf(overlaps, "%ld:%d @%lld\n", read_number, matching_offset, edge);
+  // A tail node keeps its TAIL_EDGE bit so that the id can still be walked from.
+  print_overlap_record("%ld:%d @%lld\n", read_number, matching_offset, edge);
 #endif
   return;
 }
 
+// <input>-links, written by suffixlinks: for each cell, its node's depth in the top
+// 16 bits and the cell of the longest proper suffix of its string that is also in
+// the trie.  Word 0 holds LINK_MAGIC and the identity of the -edges file the links
+// were made from.  Only used when the whole trie is on this rank.
+#define LINK_MAGIC "LINK"
+#define LINK_DEPTH_SHIFT 48
+#define LINK_CELL_MASK ((1ULL<<LINK_DEPTH_SHIFT)-1ULL)
+#define LINK_ID_BYTES 4096
+static INDEX *suffix_link;
+
+// As in suffixlinks: a hash of the size, nanosecond mtime and first bytes of -edges.
+static unsigned int edges_identity(int fd)
+{
+  unsigned char buf[LINK_ID_BYTES];
+  unsigned long long h = 14695981039346656037ULL, v[3];
+  struct stat st;
+  ssize_t n, i;
+
+  if (fstat(fd, &st) != 0) return 0;
+  v[0] = st.st_size; v[1] = st.st_mtim.tv_sec; v[2] = st.st_mtim.tv_nsec;
+  n = pread(fd, buf, sizeof(buf), (off_t)0);
+  for (i = 0; i < (ssize_t)sizeof(v); i++) h = (h ^ ((unsigned char *)v)[i]) * 1099511628211ULL;
+  for (i = 0; i < n; i++) h = (h ^ buf[i]) * 1099511628211ULL;
+  return (unsigned int)(h ^ (h >> 32));
+}
+
+static void load_links(char *input)
+{
+  char fname[1024];
+  struct stat link_st;
+  unsigned char header[8];
+  unsigned int identity;
+  ssize_t rc;
+  double seconds;
+  int fd;
+
+  sprintf(fname, "%s-links", input);
+  if (stat(fname, &link_st) != 0) return; // not made; probe every suffix from the root
+  if (tails) {
+    fprintf(stderr, "findoverlaps[%d]: ignoring %s - it cannot be used with a trie built with TAILS=1\n",
+            mpirank, fname);
+    return;
+  }
+  fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "findoverlaps[%d]: cannot load %s - %s\n", mpirank, fname, strerror(errno));
+    return;
+  }
+  identity = edges_identity(trie_file_fd);
+  if ((link_st.st_size != (off_t)(last_used_edge+1)*(off_t)sizeof(INDEX))
+      || (pread(fd, header, sizeof(header), (off_t)0) != (ssize_t)sizeof(header))
+      || (memcmp(header, LINK_MAGIC, 4) != 0) || (memcmp(header+4, &identity, 4) != 0)) {
+    fprintf(stderr, "findoverlaps[%d]: ignoring %s - it does not match the trie; rerun suffixlinks\n",
+            mpirank, fname);
+    close(fd);
+    return;
+  }
+  suffix_link = malloc(link_st.st_size);
+  if (suffix_link == NULL) {
+    fprintf(stderr, "findoverlaps[%d]: cannot load %s - %s\n", mpirank, fname, strerror(errno));
+    close(fd);
+    return;
+  }
+  seconds = load_seconds;
+  rc = load_cells(fd, suffix_link, (size_t)link_st.st_size, (off_t)0);
+  seconds = load_seconds - seconds;
+  close(fd);
+  if (rc != link_st.st_size) {
+    fprintf(stderr, "findoverlaps[%d]: cannot load %s\n", mpirank, fname);
+    free(suffix_link); suffix_link = NULL;
+    return;
+  }
+  if (mpirank == 0) fprintf(stderr, "Using suffix links from %s\n", fname);
+  fprintf(stderr, "Node %d: loaded %lld bytes of suffix links in %.2fs (%.0f MB/s on %d thread%s)\n",
+          mpirank, (long long)rc, seconds, (seconds > 0.0) ? rc / seconds / 1e6 : 0.0,
+          threads, (threads == 1) ? "" : "s");
+}
+
+// A trie lookup is a chain of dependent loads, each of which usually misses the cache,
+// so one probe at a time leaves the CPU waiting on memory.  The engines below keep
+// up to 'probes' independent probes going in lockstep, advancing each by one base per
+// round and prefetching the cell it will look at next, so that the memory latency of
+// one probe is overlapped with the work on the others.  -probes=1 gives the simple
+// one-probe-at-a-time loop, for comparison.
+#define PROBES_MAX 256
+static int probes = 32;
+static long long probes_run; // suffix probes (or, with suffix links, reads) on this rank
+
+static int base_code(int c)
+{
+  if (c == 'A') return _A_; // architecture-dependent whether this or a lookup table is faster..
+  if (c == 'C') return _C_;
+  if (c == 'G') return _G_;
+  if (c == 'T') return _T_;
+  return _N_; // some other char
+}
+
+static void trie_prefetch(INDEX idx)
+{
+  char *p = (char *)trie_cell + idx*cell_bytes;
+
+  __builtin_prefetch(p);
+  __builtin_prefetch(p + cell_bytes-1); // a cell can straddle two cache lines
+}
+
+// Carry a search on from a copy of the cell for *edge - fetched, or from the cache -
+// through our own cells and cached ones.  Returns NULL when the search is over, or
+// what is left of s with *edge set to the next node, which we don't have.
+static char *walk_cells(const unsigned char *cell, char *s, EDGE *edge, long read_number, int matching_offset)
+{
+  EDGE e = *edge;
+  long long hits = 0;
+  int print_count = 0, i;
+
+  for (;;) {
+    if (e & TAIL_EDGE) { // only one read below here
+      char tail[256];
+
+      tail_cell(cell, tail);
+      for (i = 0; s[i] != '\0'; i++) {
+        if (s[i] != tail[i]) break;
+      }
+      if (s[i] == '\0') print_overlaps(e, read_number, matching_offset, &print_count);
+      s = NULL; break;
+    }
+    e = cell_edge(cell, e, base_code(*s++)) & EDGE_MASK;
+    if (e == 0LL) { // no matches down this path
+      s = NULL; break;
+    }
+    if (!(e & TAIL_EDGE) && (*s == '\0')) {
+      print_overlaps(e, read_number, matching_offset, &print_count);
+      s = NULL; break;
+    }
+    if (chunk_of(e & ~TAIL_EDGE) == cluster_member) {
+      cell = (unsigned char *)trie_cell + LOCAL(e & ~TAIL_EDGE)*cell_bytes;
+    } else if ((cell = cached_cell(e & ~TAIL_EDGE)) != NULL) {
+      hits++;
+    } else break;
+  }
+  *edge = e;
+  if (hits > 0) {
+#pragma omp atomic
+    cache_hits += hits;
+  }
+  return s;
+}
+
+static void cache_insert(INDEX idx)
+{
+  unsigned long slot, mask = (1UL << cache_shift) - 1UL;
+
+  for (slot = CACHE_SLOT(idx); cache_key[slot] != 0; slot = (slot+1) & mask) {
+    if (cache_key[slot] == idx) return;
+  }
+  cache_key[slot] = idx;
+  cache_at[slot] = (unsigned int)cache_held++;
+}
+
+// Fill the cache from the edges that leave our chunk, taken in cell order (after relayout
+// that puts the nodes nearest the root first), and then breadth-first below them
+// through the cells we have copied, so that only cells of other ranks are ever queued
+// and the work and memory go with the size of the cache rather than of our chunk.  The
+// cells copied are the real ones whatever led to them, so the odd bogus edge read from
+// a tail cell of ours costs only a slot.  Each level's cells are fetched together, a
+// batch of Gets to a round trip.
+#define CACHE_BATCH 4096
+static void fill_cache(void)
+{
+  long long wanted = cache_cells;
+  INDEX trie_end = chunk_base[cluster_size], cells = chunk_base[cluster_member+1] - local_base, cell;
+  EDGE *level, *next, *swap;
+  size_t level_count = 0, next_count, i;
+  double start = MPI_Wtime();
+  int depth = 0, pending, c;
+
+  if (wanted > (long long)(trie_end - chunk_base[1])) {
+    wanted = (long long)(trie_end - chunk_base[1]); // all there is
+  }
+  if ((wanted <= 0) || (wanted > (long long)UINT_MAX)) return;
+  for (cache_shift = 1; (1LL << cache_shift) < 2*wanted; cache_shift++) ;
+  cache_key = calloc(1UL << cache_shift, sizeof(INDEX));
+  cache_at = malloc((1UL << cache_shift) * sizeof(unsigned int));
+  cache_cell = malloc((size_t)wanted*cell_bytes);
+  level = malloc((size_t)wanted*sizeof(EDGE));
+  next = malloc((size_t)wanted*sizeof(EDGE));
+  if ((cache_key == NULL) || (cache_at == NULL) || (cache_cell == NULL) || (level == NULL) || (next == NULL)) {
+    fprintf(stderr, "findoverlaps[%d]: cannot allocate a cache of %lld cells\n", mpirank, wanted);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  for (cell = (local_base < ROOT_CELL) ? ROOT_CELL-local_base : 0; cell < cells; cell++) {
+    const unsigned char *p = (unsigned char *)trie_cell + cell*cell_bytes;
+
+    for (c = 0; (c <= _N_) && (level_count < (size_t)wanted); c++) {
+      EDGE e = cell_edge(p, local_base+cell, c);
+      INDEX idx = e & ~TAIL_EDGE;
+
+      if ((e == 0LL) || (e & ENDS_WORD) || (idx >= trie_end) || (chunk_of(idx) == cluster_member)) continue;
+      level[level_count++] = e;
+    }
+    if (level_count == (size_t)wanted) break;
+  }
+
+  while ((level_count > 0) && (cache_held < wanted)) {
+    // Copy this level's cells from the other ranks, as many as there is room for,
+    pending = 0;
+    for (i = 0; (i < level_count) && (cache_held < wanted); i++) {
+      INDEX idx = level[i] & ~TAIL_EDGE;
+
+      if (cached_cell(idx) != NULL) continue;
+      rma_get(idx, cache_cell + (size_t)cache_held*cell_bytes);
+      cache_insert(idx);
+      if (++pending == CACHE_BATCH) {
+        MPI_Win_flush_local_all(trie_win);
+        pending = 0;
+      }
+    }
+    if (pending > 0) MPI_Win_flush_local_all(trie_win);
+    level_count = i;
+    depth++;
+
+    // and queue their children that are on other ranks too.
+    next_count = 0;
+    for (i = 0; (i < level_count) && (next_count < (size_t)(wanted - cache_held)); i++) {
+      INDEX idx = level[i] & ~TAIL_EDGE;
+      const unsigned char *p = cached_cell(idx);
+
+      if (level[i] & TAIL_EDGE) continue; // packed bases, not edges
+      for (c = 0; (c <= _N_) && (next_count < (size_t)(wanted - cache_held)); c++) {
+        EDGE e = cell_edge(p, idx, c);
+
+        if ((e == 0LL) || (e & ENDS_WORD) || ((e & ~TAIL_EDGE) >= trie_end)
+            || (chunk_of(e & ~TAIL_EDGE) == cluster_member)) continue;
+        next[next_count++] = e;
+      }
+    }
+    swap = level; level = next; next = swap;
+    level_count = next_count;
+  }
+  free(level); free(next);
+  fprintf(stderr, "Node %d: cached %lld cells from other nodes, up to %d levels below our own, in %.2fs\n",
+          mpirank, cache_held, depth, MPI_Wtime() - start);
+}
+
+// With -rma, each thread collects up to RMA_BATCH searches that have left our chunk and
+// then runs them together: one round trip fetches the next cell of every one of them,
+// then each goes as far as it can - through any of our own cells too - until it needs
+// another cell from elsewhere.
+#define RMA_BATCH 64
+typedef struct {
+  EDGE edge;                        // the node whose cell we need next
+  long read_number;
+  int matching_offset, at;          // at: how much of text has been matched
+  unsigned char cell[sizeof(CELL)]; // and, once fetched, a copy of it
+  char text[MAX_LINE];
+} RMA_SEARCH;
+static RMA_SEARCH *rma_search;      // [thread*RMA_BATCH + i]
+static int *rma_waiting;            // per thread
+
+static int rma_step(RMA_SEARCH *r) // TRUE if it needs another cell fetched
+{
+  char *s = walk_cells(r->cell, r->text + r->at, &r->edge, r->read_number, r->matching_offset);
+
+  if (s == NULL) return FALSE;
+  r->at = s - r->text;
+  return TRUE;
+}
+
+static void rma_walk(int thread)
+{
+  RMA_SEARCH *r = &rma_search[thread*RMA_BATCH];
+  int live = rma_waiting[thread], i;
+  double start;
+
+  rma_waiting[thread] = 0;
+  while (live > 0) {
+    start = MPI_Wtime();
+#pragma omp critical (mpi)
+    {
+      for (i = 0; i < live; i++) rma_get(r[i].edge & ~TAIL_EDGE, r[i].cell);
+      MPI_Win_flush_local_all(trie_win);
+    }
+#pragma omp critical (rma)
+    {
+      rma_fetches += live; rma_rounds++; rma_wait += MPI_Wtime() - start;
+    }
+    for (i = 0; i < live; ) {
+      if (rma_step(&r[i])) i++;
+      else if (i != --live) r[i] = r[live];
+    }
+  }
+}
+
+static void rma_queue(char *s, EDGE edge, long read_number, int matching_offset)
+{
+  int thread = omp_get_thread_num();
+  RMA_SEARCH *r = &rma_search[thread*RMA_BATCH + rma_waiting[thread]++];
+
+  r->edge = edge; r->read_number = read_number; r->matching_offset = matching_offset;
+  r->at = 0; strcpy(r->text, s);
+  if (rma_waiting[thread] == RMA_BATCH) rma_walk(thread);
+}
+
+// Find the same overlaps as calling locate_overlaps on each suffix of each read in
+// turn, longest first, in one pass per read: run the read through the trie, following
+// suffix links on a mismatch, to reach the longest suffix of it that is a path in the
+// trie, then print that and each suffix that its chain of links leads to.  'reads'
+// reads are run through together.
+static void locate_overlaps_linked(char line[][MAX_LINE], INDEX *read_number, int reads)
+{
+  char *s[PROBES_MAX];
+  INDEX node[PROBES_MAX], depth[PROBES_MAX];
+  int active[PROBES_MAX], live = 0, i, k, c, print_count;
+  EDGE edge;
+
+  for (i = 0; i < reads; i++) {
+    s[i] = line[i]; node[i] = ROOT_CELL; depth[i] = 0;
+    if (*s[i] != '\0') active[live++] = i;
+  }
+  while (live > 0) {
+    for (k = 0; k < live; k++) {
+      i = active[k];
+      c = base_code(*s[i]);
+      edge = trie_edge(LOCAL(node[i]), c);
+      if ((edge != 0LL) && !(edge & ENDS_WORD)) { // (a read end is the whole read: not wanted)
+        node[i] = edge; depth[i]++; s[i]++;
+      } else if (node[i] == ROOT_CELL) {
+        s[i]++;
+      } else { // try c again on the next shorter suffix
+        node[i] = suffix_link[node[i]] & LINK_CELL_MASK;
+        depth[i] = suffix_link[node[i]] >> LINK_DEPTH_SHIFT;
+      }
+      if (*s[i] == '\0') active[k--] = active[--live];
+      else trie_prefetch(LOCAL(node[i]));
+    }
+  }
+
+  for (i = 0; i < reads; i++) {
+    while ((node[i] != ROOT_CELL) && (depth[i] >= MIN_OVERLAP)) {
+      print_count = 0;
+      print_overlaps(node[i], read_number[i], read_length - depth[i], &print_count);
+      node[i] = suffix_link[node[i]] & LINK_CELL_MASK;
+      depth[i] = suffix_link[node[i]] >> LINK_DEPTH_SHIFT;
+    }
+  }
+#pragma omp atomic
+  probes_run += reads;
+}
+
+// The same as calling locate_overlaps(suffix, ROOT_CELL, ...) for each suffix of line
+// from read_length-1 bases down to MIN_OVERLAP, with the probes interleaved.  A probe
+// runs here while it stays in our chunk; one that reaches a tail or another rank's
+// chunk is handed to locate_overlaps.  Results go out in the original order.
+#define PROBE_RUNNING 0
+#define PROBE_MISSED 1
+#define PROBE_FOUND 2
+#define PROBE_HANDOFF 3
+static void locate_overlaps_interleaved(char *line, INDEX read_number)
+{
+  char *s[MAX_LINE];
+  EDGE edge[MAX_LINE];
+  int state[MAX_LINE], active[PROBES_MAX];
+  int suffixes = read_length - MIN_OVERLAP, started = 0, live = 0, i, k, print_count;
+
+  for (;;) {
+    while ((live < probes) && (started < suffixes)) {
+      i = started++; // suffix i starts at line[1+i] and matches at offset 1+i
+      s[i] = line+1+i; edge[i] = ROOT_CELL; state[i] = PROBE_RUNNING;
+      active[live++] = i;
+    }
+    if (live == 0) break;
+    for (k = 0; k < live; k++) {
+      EDGE e;
+
+      i = active[k];
+      e = trie_edge(LOCAL(edge[i]), base_code(*s[i]++)) & EDGE_MASK;
+      if (e == 0LL) state[i] = PROBE_MISSED;
+      else {
+        edge[i] = e;
+        if (e & TAIL_EDGE) state[i] = PROBE_HANDOFF;
+        else if ((*s[i] == '\0') || (*s[i] == '\n') || (*s[i] == '\r')) state[i] = PROBE_FOUND;
+        else if (chunk_of(e) != cluster_member) state[i] = PROBE_HANDOFF;
+        else trie_prefetch(LOCAL(e));
+      }
+      if (state[i] != PROBE_RUNNING) active[k--] = active[--live];
+    }
+  }
+
+  for (i = 0; i < suffixes; i++) {
+    if (state[i] == PROBE_FOUND) {
+      print_count = 0;
+      print_overlaps(edge[i], read_number, 1+i, &print_count);
+    } else if (state[i] == PROBE_HANDOFF) {
+      locate_overlaps(s[i], edge[i], read_number, 1+i);
+    }
+  }
+#pragma omp atomic
+  probes_run += suffixes;
+}
+
+// THIS IS THE "EMBARASSINGLY PARALLEL" MAIN LOOP, RUNNING ON MULTIPLE NODES, and on
+// every thread of each.  The threads take reads from a shared cursor over the group's
+// share of -sorted, a batch at a time, so that a thread which gets easy reads just takes
+// more of them.  (The main loop was once a "#pragma omp parallel for" over the suffixes
+// of a read, which took fake100m from about 1hr to 40m, but it broke once MPI groups
+// were added as every thread could call MPI at once.)
+static long next_sorted; // the first of our group's reads that no thread has taken yet
+
+static void find_overlaps_worker(void)
+{
+  char (*line)[MAX_LINE] = malloc(PROBES_MAX * MAX_LINE);
+  INDEX original_read_number[PROBES_MAX];
+  long first;
+  int len, batch, b;
+  char *s;
+
+  if (line == NULL) {
+    fprintf(stderr, "findoverlaps[%d]: out of memory for a thread's reads\n", mpirank);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  for (;;) {
+    // With suffix links a batch of reads is run through the trie together, otherwise
+    // the suffixes of one read are.
+    batch = (suffix_link != NULL) ? probes : 1;
+#pragma omp atomic capture
+    { first = next_sorted; next_sorted += batch; }
+    if (first >= sorted_count) break;
+    if (batch > sorted_count - first) batch = sorted_count - first;
+    for (b = 0; b < batch; b++) original_read_number[b] = sorted_read(first+b, line[b]);
+
+    if (suffix_link != NULL) {
+      locate_overlaps_linked(line, original_read_number, batch); // all the suffixes at once
+    } else if (probes > 1) {
+      locate_overlaps_interleaved(line[0], original_read_number[0]);
+    } else {
+      s = line[0]; // The loop below skips the first letter of the target -
+                   //  we already handled dups elsewhere
+
+      for (len = read_length-1; len >= MIN_OVERLAP; len--) {
+        // (MIN_OVERLAP may not be needed if AMOS_OVERLAPS is not defined.)
+
+        locate_overlaps(s-len+read_length, ROOT_CELL, original_read_number[0],
+          /* OFFSET 1..37 */ read_length-len);   // The meat in the sandwich...
+
+      }
+#pragma omp atomic
+      probes_run += read_length - MIN_OVERLAP;
+    }
+
+    if ((mpirank == 0) && (((first + batch) / 1000000) != (first / 1000000))) {
+      char when[32];
+      time_t curtime;
+
+      time(&curtime);
+      fprintf(stderr, "%ld READs processed for overlaps at %s", first + batch, ctime_r(&curtime, when));
+    }
+  }
+  free(line);
+}
+
 int main(int argc, char **argv)
 {
   /*  (local declarations) */
@@ -442,8 +1504,8 @@ int main(int argc, char **argv)
   char fname[1024];
   //char line[MAX_LINE];
   int rc; // i, c
-  long read_number = 0;
-  int namelen;
+  double start_time, elapsed;
+  int namelen, i;
   int required=MPI_THREAD_SERIALIZED; // Required level of MPI threading support
   /* Each thread will call MPI routines, but these calls will be coordinated
      to occur only one at a time within a process.
@@ -458,6 +1520,7 @@ int main(int argc, char **argv)
   // Determine the MPI rank, number of processes, and processor name
   MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
   MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
+  MPI_Comm_dup(MPI_COMM_WORLD, &reply_comm);
   //fprintf(stderr, "I am rank %d of world size %d\n", mpirank, mpisize);
   MPI_Get_processor_name(processor_name, &namelen);
   if (processor_name && strchr(processor_name, '.')) *strchr(processor_name, '.') = '\0';
@@ -474,8 +1537,26 @@ int main(int argc, char **argv)
     }
     omp_set_num_threads(1);
   }
-
+  threads = omp_get_max_threads();
   /*  Command-line parameter handling and file opening */
+  while ((argc > 2) && (argv[1][0] == '-')) {
+    if (strcmp(argv[1], "-rma") == 0) {
+      rma = TRUE;
+    } else if (strcmp(argv[1], "-private") == 0) {
+      private_chunks = TRUE;
+    } else if (strcmp(argv[1], "-hugepages") == 0) {
+      hugepages = TRUE;
+    } else if (strncmp(argv[1], "-cache=", 7) == 0) {
+      cache_cells = atoll(argv[1]+7);
+    } else if (strncmp(argv[1], "-probes=", 8) == 0) {
+      probes = atoi(argv[1]+8);
+      if (probes < 1) probes = 1;
+      if (probes > PROBES_MAX) probes = PROBES_MAX;
+    } else if (mpirank == 0) {
+      fprintf(stderr, "warning: unknown option %s ignored...\n", argv[1]);
+    }
+    argc--; argv++;
+  }
   if ((mpirank == 0) && (argc > 2)) {
     fprintf(stderr, "warning: extra parameter %s ignored...\n", argv[2]);
   }
@@ -500,17 +1581,64 @@ int main(int argc, char **argv)
     //fprintf(stderr, "Overlap Output[%d]: %s\n", mpirank, fname);
 
   } else {
-    if (mpirank == 0) fprintf(stderr, "syntax: findoverlaps input.fastq\n");
+    if (mpirank == 0) fprintf(stderr, "syntax: findoverlaps [-probes=N] [-rma] [-private] [-hugepages] [-cache=N] input.fastq\n");
     MPI_Finalize();
     exit(EXIT_FAILURE);
   }
   
+  /* The trie layout decides how many cells fit in memory, so read its header first. */
+  {
+    unsigned char header[8];
+    int fd;
+
+    sprintf(fname, "%s-edges", argv[1]);
+    fd = open(fname, O_RDONLY);
+    if ((fd >= 0) && (read(fd, header, sizeof(header)) == sizeof(header))
+        && (memcmp(header, TRIE_MAGIC, 4) == 0)) {
+      edge_bytes = header[4];
+      edge_ways = header[5];
+      tails = header[6];
+      if (((edge_ways != 4) && (edge_ways != 5)) || ((edge_bytes != 4) && (edge_bytes != 5) && (edge_bytes != 8)) || (tails > 1)) {
+        if (mpirank == 0) fprintf(stderr, "findoverlaps: unsupported trie format (%d-byte edges, %d per cell)\n",
+                                  header[4], header[5]);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+      }
+      cell_bytes = edge_bytes*edge_ways;
+      if (mpirank == 0) fprintf(stderr, "Trie uses %d-bit edges, %d per cell%s\n", edge_bytes*8, edge_ways,
+                                tails ? ", with packed read tails" : "");
+    }
+    if (fd >= 0) close(fd);
+  }
+
+  if (edge_ways == 4) {
+    FILE *f;
+    long bytes;
+
+    sprintf(fname, "%s-nedges", argv[1]);
+    f = fopen(fname, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "findoverlaps: cannot access N edge file %s - %s\n", fname, strerror(errno));
+      MPI_Finalize();
+      exit(EXIT_FAILURE);
+    }
+    fseek(f, 0L, SEEK_END); bytes = ftell(f); fseek(f, 0L, SEEK_SET);
+    nedge_count = bytes / (2*sizeof(unsigned long long));
+    nedges = malloc(nedge_count*2*sizeof(unsigned long long) + 1);
+    if ((nedges == NULL) || (fread(nedges, 2*sizeof(unsigned long long), nedge_count, f) != (size_t)nedge_count)) {
+      fprintf(stderr, "findoverlaps: cannot load N edge file %s\n", fname);
+      MPI_Finalize();
+      exit(EXIT_FAILURE);
+    }
+    fclose(f);
+  }
+
   /* OS-dependent (Linux) code below lets us grab as much memory as possible in a single chunk. */
 
   // DO NOT throw this away and attempt to build the trie using individual cells claimed from malloc.
   // Sequential memory allocation is *critical* to the speed of the program.
 
-  CHUNKBITS = (((INDEX)sizeof(INDEX)) * 8ULL) - 1ULL;
+  CHUNKSIZE = 1LL<<30LL; // if MemTotal cannot be read, as much as calloc gives us
   {
     FILE *meminfo, *cpuinfo;
     long long memsize;
@@ -546,39 +1674,34 @@ int main(int argc, char **argv)
         fprintf(stderr, "got memsize %lld kB\n", memsize);
         memsize *= 1024ULL; // re-scale to bytes
         memsize /= TASKS_PER_NODE; // availability per processor
-        memsize /= (long long)sizeof(CELL); // convert to cell count
-
-        CHUNKBITS = 1ULL;
-        for (;;) {
-          if ((1ULL << CHUNKBITS) >= memsize) break;
-          CHUNKBITS++;
-	}
-        CHUNKBITS -= 1ULL;
+        memsize /= (long long)cell_bytes; // convert to cell count
+
+        CHUNKSIZE = memsize - (memsize >> 4); // all of it, less a sixteenth for the system
         if (mpirank == 0) fprintf(stderr,
-        "Rounding down memsize to %lldM cells per core (%lld bits), ie %lldM cells per node\n",
-                (1ULL<<CHUNKBITS)>>24ULL,
-                CHUNKBITS,
-                ((1ULL<<CHUNKBITS)*TASKS_PER_NODE)>>24ULL);
+        "Using %lldM cells per core, ie %lldM cells per node\n",
+                CHUNKSIZE>>20LL,
+                (CHUNKSIZE*TASKS_PER_NODE)>>20LL);
 	break;
-      } else {
-        CHUNKBITS = CHUNKBITS>>1ULL;
       }
     }
   }
-  CHUNKSIZE = (1ULL<<CHUNKBITS); /* index to local array is 0..CHUNKSIZE */
-  CHUNKMASK = (CHUNKSIZE-1ULL);
 
-  while (CHUNKBITS >= 16ULL) { // absolute minimum, no point in going below this!
+  while (CHUNKSIZE >= (1LL<<16LL)) { // absolute minimum, no point in going below this!
     fprintf(stderr, "Node %d: trying calloc of %lld cells of %d bytes each.\n",
-            mpirank, CHUNKSIZE, (int)sizeof(CELL));
-    trie_cell = calloc(CHUNKSIZE, sizeof(CELL)); // trie_cell[0..CHUNKSIZE]
+            mpirank, CHUNKSIZE, cell_bytes);
+    trie_cell = calloc(CHUNKSIZE, cell_bytes); // trie_cell[0..CHUNKSIZE]
     if (trie_cell == NULL) {
-      CHUNKBITS -= 1ULL;
-      CHUNKSIZE = (1ULL<<CHUNKBITS);
-      CHUNKMASK = (CHUNKSIZE-1ULL);
+      CHUNKSIZE -= CHUNKSIZE >> 3;
     } else break; // malloc successful
   }
 
+#ifdef MULTINODE_DEBUG1K
+  CHUNKSIZE = 512;
+#endif
+#ifdef MULTINODE_DEBUG_UNEVEN
+  CHUNKSIZE = 300 + 57 * mpirank;
+#endif
+
   if (trie_cell == NULL) {
     fprintf(stderr,
             "findoverlaps: rank %d unable to allocate array of %lld longs\n", mpirank, CHUNKSIZE);
@@ -605,70 +1728,108 @@ int main(int argc, char **argv)
       exit(EXIT_FAILURE);
     }
     file_length = lseek(trie_file_fd, (off_t)0LL, SEEK_END);
-    last_used_edge = file_length/sizeof(CELL)-1LL;
+    last_used_edge = file_length/cell_bytes-1LL;
 
-    cluster_size = (last_used_edge + (CHUNKSIZE-1)) / CHUNKSIZE;
+    // Split the ranks, in order, into as many clusters as can each hold the whole trie.
+    {
+      long long *chunk = malloc(mpisize * sizeof(long long));
+      int r = 0, used = 0, k;
 
-    if (mpisize < cluster_size) {
-      if (mpirank == 0) fprintf(stderr, "ERROR: We need %d or more compute nodes to be allocated - we only have %d\n",
-                                cluster_size, mpisize);
-      MPI_Finalize(); // release this processor back to the pool.  I have no use for it.
-      exit(0);
-    }
+      chunk_base = malloc((mpisize+1) * sizeof(INDEX));
+      if ((chunk == NULL) || (chunk_base == NULL)) {
+        fprintf(stderr, "findoverlaps: rank %d cannot allocate the chunk table\n", mpirank);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      MPI_Allgather(&CHUNKSIZE, 1, MPI_LONG_LONG, chunk, 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+      clusters = 0; cluster_size = 0;
+      while (r < mpisize) {
+        int first = r;
+        INDEX covered = 0;
+
+        while ((r < mpisize) && (covered < (INDEX)last_used_edge+1)) covered += chunk[r++];
+        if (covered < (INDEX)last_used_edge+1) break;
+        if ((first <= mpirank) && (mpirank < r)) {
+          cluster_base = first; cluster_size = r - first; cluster_index = clusters;
+        }
+        clusters++; used = r;
+      }
+      // (One window over every group, rather than one per group: OpenMPI 4.1 can give the
+      // shared memory behind windows on disjoint communicators the same name.)
+      if (rma || (cache_cells > 0)) MPI_Comm_split(MPI_COMM_WORLD, (cluster_size > 0) ? 0 : MPI_UNDEFINED, mpirank, &work_comm);
+      if (!private_chunks) {
+        MPI_Comm host_comm;
+
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, mpirank, MPI_INFO_NULL, &host_comm);
+        MPI_Comm_split(host_comm, (cluster_size > 0) ? 0 : MPI_UNDEFINED, mpirank, &node_comm);
+        MPI_Comm_free(&host_comm);
+      }
 
-    if ((mpisize / cluster_size) > 1) {
-      if (mpirank == 0) fprintf(stderr, "We expect a parallel speedup by a factor of %d\n",
-              mpisize / cluster_size);
-    }
+      if (clusters == 0) {
+        if (mpirank == 0) fprintf(stderr, "ERROR: We need more compute nodes to be allocated - %d cannot hold %lld cells\n",
+                                  mpisize, last_used_edge+1);
+        MPI_Finalize(); // release this processor back to the pool.  I have no use for it.
+        exit(0);
+      }
 
-    if (mpirank >= ((mpisize / cluster_size) * cluster_size)) {
-      fprintf(stderr,
-              "*** WARNING: Node %d is not needed (last required node is %d) - releasing it...\n",
-              mpirank, (mpisize / cluster_size) * cluster_size - 1);
-      if (overlaps) fclose(overlaps); overlaps = NULL; // Would prefer never to have opened it...
-      MPI_Finalize(); // release this processor back to the pool.  I have no use for it.
-      exit(0);
-    }
+      if (clusters > 1) {
+        if (mpirank == 0) fprintf(stderr, "We expect a parallel speedup by a factor of %d\n",
+                clusters);
+      }
 
-    cluster_base = (mpirank / cluster_size) * cluster_size;
+      if (cluster_size == 0) {
+        fprintf(stderr,
+                "*** WARNING: Node %d is not needed (last required node is %d) - releasing it...\n",
+                mpirank, used - 1);
+        if (overlaps) fclose(overlaps); overlaps = NULL; // Would prefer never to have opened it...
+        MPI_Finalize(); // release this processor back to the pool.  I have no use for it.
+        exit(0);
+      }
+
+      cluster_member = mpirank - cluster_base;
+      chunk_uniform = chunk[cluster_base];
+      chunk_base[0] = 0;
+      for (k = 0; k < cluster_size; k++) {
+        if (chunk[cluster_base+k] != (long long)chunk_uniform) chunk_uniform = 0;
+        chunk_base[k+1] = chunk_base[k] + chunk[cluster_base+k];
+      }
+      chunk_base[cluster_size] = last_used_edge+1; // the last member takes the remainder
+      free(chunk);
+    }
+    local_base = chunk_base[cluster_member];
+    if ((cluster_size > 1) && !rma) start_network();
 
     fprintf(stderr, "Node %d: cluster is %d..%d\n", mpirank, cluster_base, cluster_base+cluster_size-1);
 
-    if ((mpirank%cluster_size) < cluster_size-1) {
-      // LOAD 'CHUNKSIZE'
-      segment_size = CHUNKSIZE * sizeof(CELL);
+    segment_size = (chunk_base[cluster_member+1] - local_base) * cell_bytes;
+    if (cluster_member < cluster_size-1) {
       fprintf(stderr, "Node %d: Loading full sized chunk. (%lld)\n", mpirank, (long long int)segment_size);
-    } else if ((mpirank%cluster_size) == cluster_size-1) {
-      // LOAD the remaining data <= CHUNKSIZE at the end of the array
-      segment_size = ((last_used_edge & CHUNKMASK)+1) * sizeof(CELL);
-      fprintf(stderr, "Node %d: Loading remainder of last chunk. (%lld)\n", mpirank, (long long int)segment_size);
     } else {
-      // (mpirank%cluster_size) >= cluster_size - can't happen
-      //assert((mpirank%cluster_size) < cluster_size);
-      exit(1);
+      fprintf(stderr, "Node %d: Loading remainder of last chunk. (%lld)\n", mpirank, (long long int)segment_size);
     }
 
     //fprintf(stderr, "Node %d: mapping %ld bytes of %s at offset %ld\n",
-    //        mpirank, segment_size, argv[1], (mpirank%cluster_size)*CHUNKSIZE*sizeof(CELL));
+    //        mpirank, segment_size, argv[1], local_base*sizeof(CELL));
 
 
     // MEMORY MAPPING HAS BEEN REMOVED DUE TO SLOW SPEED:
     if (trie_cell != NULL) free(trie_cell);
     trie_cell = NULL;//mmap(NULL, (size_t)segment_size, PROT_READ, MAP_PRIVATE/*SHARED*/,
-                     //     trie_file_fd, (off_t)(mpirank%cluster_size)*(off_t)CHUNKSIZE*sizeof(CELL));
+                     //     trie_file_fd, (off_t)local_base*sizeof(CELL));
 
 
-    if ((trie_cell == NULL) || (trie_cell == (void *)-1)) {
+    if (load_shared_chunk(trie_file_fd)) {
+      // (loaded once for all of the ranks on this host)
+    } else if ((trie_cell == NULL) || (trie_cell == (void *)-1)) {
       ssize_t rc;
       //fprintf(stderr, "findoverlaps[%d]: failed to map %s - %s - loading into RAM instead\n",
       //         mpirank, fname, strerror(errno));
-      trie_cell = malloc(segment_size);
-      rc = retrying_pread(trie_file_fd, trie_cell, (size_t)segment_size,
-                          (off_t)(mpirank%cluster_size)*(off_t)CHUNKSIZE*sizeof(CELL));
+      trie_cell = allocate_cells(segment_size);
+      rc = (trie_cell == NULL) ? -1 : load_cells(trie_file_fd, trie_cell, (size_t)segment_size,
+                                                 (off_t)local_base*cell_bytes);
       if (rc != segment_size) {
 	fprintf(stderr,
                 "findoverlaps[%d]: failed to fetch %ld bytes from offset 0x%llx on file %d, rc = %ld\n",
-		mpirank,segment_size, (mpirank%cluster_size)*CHUNKSIZE, trie_file_fd, rc);
+		mpirank,segment_size, local_base, trie_file_fd, rc);
 	exit(1);
       }
     } else {
@@ -677,20 +1838,55 @@ int main(int argc, char **argv)
       // start up more quickly.  (Turns out it slows down overall... removed...)
       //fprintf(stderr, "findoverlaps[%d]: loaded %ld bytes at %p\n", mpirank, segment_size, trie_cell);
     }
+    if (load_bytes > 0) {
+      fprintf(stderr, "Node %d: loaded %lld bytes of trie in %.2fs (%.0f MB/s on %d thread%s%s)\n",
+              mpirank, load_bytes, load_seconds, (load_seconds > 0.0) ? load_bytes / load_seconds / 1e6 : 0.0,
+              threads, (threads == 1) ? "" : "s", (hugepage_bytes > 0) ? ", huge pages" : "");
+    }
     //fprintf(stderr, "Node %d: last_used_edge: %lld,  CHUNKSIZE: %lld\n",
     //        mpirank, last_used_edge, CHUNKSIZE);
   }
   
 
-  if ((mpirank%cluster_size) == 0) {
+  outbuf = calloc(threads, sizeof(OUTBUF));
+  for (i = 0; (outbuf != NULL) && (i < threads); i++) {
+    outbuf[i].text = malloc(OUTBUF_SIZE);
+    if (outbuf[i].text == NULL) outbuf = NULL;
+  }
+  if (outbuf == NULL) {
+    fprintf(stderr, "findoverlaps[%d]: cannot allocate output buffers\n", mpirank);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  if (rma || (cache_cells > 0)) {
+    // Expose our chunk to the rest of the group.  Only the base rank reads from the window,
+    // for -rma or to fill its -cache, and it holds a shared lock on every rank's chunk
+    // for the whole run.
+    MPI_Win_create(trie_cell, (MPI_Aint)segment_size, 1, MPI_INFO_NULL, work_comm, &trie_win);
+    if ((cluster_member == 0) && (cluster_size > 1)) {
+      if (rma) {
+        rma_search = malloc(threads*RMA_BATCH*sizeof(RMA_SEARCH));
+        rma_waiting = calloc(threads, sizeof(int));
+        if ((rma_search == NULL) || (rma_waiting == NULL)) {
+          fprintf(stderr, "findoverlaps[%d]: cannot allocate the remote searches\n", mpirank);
+          MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+      }
+      MPI_Win_lock_all(MPI_MODE_NOCHECK, trie_win);
+    }
+  }
+
+  if (cluster_member == 0) {
+    int networked = (cluster_size > 1) && !rma;
+
     // --------------------------- MAIN BODY OF CODE ON PRIMARY PROCESSORS ----------------------------
     if (mpirank == 0) fprintf(stderr,
             "\nCombined system is using %lldM trie edges distributed across %d nodes.\n\n",
-            (long long)mpisize * (CHUNKSIZE >> 24ULL), mpisize
+            (long long)(chunk_base[cluster_size] >> 20ULL), cluster_size
            );
     if (mpirank == 0) fprintf(stderr,
             "This is enough for %d copies of the database...\n\n",
-            mpisize / cluster_size
+            clusters
            );
 
 
@@ -703,164 +1899,102 @@ int main(int argc, char **argv)
             " against the trie of all unique reads...\n\n");
 
     // IF WE ARE RUNNING MORE THAN ONE GROUP OF NODES, 'BASE' PROCESSOR OF EACH GROUP NEEDS
-    // TO READ DIFFERENT SECTIONS OF THIS FILE.  EITHER INTERLEAVING LINES, OR BY LARGER BLOCKS.
+    // TO READ DIFFERENT SECTIONS OF THIS FILE.  Each group takes a contiguous 1/N of the
+    // reads, and maps only that part of the file.
 
     sprintf(fname, "%s-sorted", argv[1]);
-    read_number = 0;
-    read_file_sorted = fopen(fname, "r");
-    if (read_file_sorted == NULL) {
-      fprintf(stderr, "findoverlaps[%d]: cannot reopen input \"%s\" - %s\n",
-              mpirank, argv[1], strerror(errno));
-      shut_down_other_nodes();
-      MPI_Finalize();
-      exit(EXIT_FAILURE);
-    }
+    load_sorted(fname, cluster_index, clusters);
+    read_length = sorted_header.read_length;
+    if (cluster_size == 1) load_links(argv[1]);
 
-    // This loop is executed on the base node of each group.  This doesn't give perfectly balanced
-    // processing, but it is fairly close.  Rather than split the data up into chunks, we simply
-    // have each of the <N> processing groups skip all but 1/N of the lines from the input file.
+    if ((cache_cells > 0) && (cluster_size > 1)) fill_cache();
 
     time(&curtime); if (mpirank == 0) fprintf(stderr, "\nStarting comparisons at %s", ctime(&curtime));
 
-    for (;;) {  // THIS IS THE "EMBARASSINGLY PARALLEL" MAIN LOOP, RUNNING ON MULTIPLE NODES.
-                // If we needed to, we could make this a null-process in a polling loop.
-                // But Master/Slave is working well enough for now...
-      char line[MAX_LINE];
-      int len, c;
-      char *s;
-      INDEX original_read_number;
-
-      s = line;
-      for (;;) {
-        c = fgetc(read_file_sorted);
-        if ((c == EOF) || ferror(read_file_sorted)) break;
-        *s++ = c;
-        if (c == '\n') break;
-      }
-      if ((c == EOF) || ferror(read_file_sorted)) break;
-
-      *--s = '\0';
-
-      if (read_length == 0) {
-        s = line;
-        while (*s++ != ' ') read_length += 1;
-      }
-
-      read_number++;
-
-      if (strlen(line) != read_length+13) continue;
-
-      s = line+read_length+1;
-      while (*s == ' ') s++;
-      if (!isdigit(*s)) continue;
-
-      original_read_number = atoll(s);
-
-      line[read_length] = '\0';
-      s = line; // The loop below skips the first letter of the target -
-                //  we already handled dups elsewhere
-
-      // Adding the pragma below brings the time taken to process fake100m
-      // down from about 1hr to about 40m.  Not a huge win but not bad for 
-      // a single line of meta-code.  The results are identical except for
-      // being in a slightly different order.  The parallelism is only happening
-      // on the master rank - we're not accepting multiple requests yet
-      // on the slave ranks.
-
-      // HOWEVER!!!! when I added parallel MPI support (multiple compute groups),
-      // this broke.  Had to comment it out...  have not yet retested this
-      // subsequent to getting the MPI parallelism to work. (which may be enough)
-
-      // just process every <n>th line when we have <n> compute groups.
-      if ((read_number%(mpisize/cluster_size)) == (cluster_base/cluster_size)) {
-
-//#pragma omp parallel for
-        for (len = read_length-1; len >= MIN_OVERLAP; len--) {
-          // (MIN_OVERLAP may not be needed if AMOS_OVERLAPS is not defined.)
-
-    	  locate_overlaps(s-len+read_length, ROOT_CELL, original_read_number,
-            /* OFFSET 1..37 */ read_length-len);   // The meat in the sandwich...
-
+    // Every thread on the base rank of each group works through the group's reads.  When
+    // the trie is spread over the group, thread 0 instead looks after the network, and the
+    // others go on to carry out searches passed back to us once the reads are done.  (A
+    // lone thread looks after the network itself once it has done the reads.)
+    // With -rma there is no network to look after: the threads fetch what they need.
+    start_time = MPI_Wtime();
+    workers_running = (networked && (threads > 1)) ? threads-1 : threads;
+#pragma omp parallel num_threads(threads)
+    {
+      if (networked && (threads > 1) && (omp_get_thread_num() == 0)) {
+        run_network();
+      } else {
+        find_overlaps_worker();
+        if (networked) flush_hops(omp_get_thread_num());
+        if (rma && (cluster_size > 1)) rma_walk(omp_get_thread_num()); // the last few
+#pragma omp atomic
+        workers_running--;
+        if (networked) {
+          if (threads > 1) handle_requests(); else run_network();
         }
-
-      }
-
-      if ((read_number % 1000000) == 0) {
-        time(&curtime);
-        if (mpirank == 0) fprintf(stderr, "%ld READs processed for overlaps at %s", read_number,
-                ctime(&curtime));
       }
     }
-
-    if (read_file_sorted) {
-      rc = fclose(/* input */ read_file_sorted); read_file_sorted = NULL;
-      if (rc == EOF) {
-        fprintf(stderr, "findoverlaps[%d]: cannot close input \"%s\" - %s\n", 
-                mpirank, argv[1], strerror(errno));
-        shut_down_other_nodes();
-        MPI_Finalize();
-        exit(EXIT_FAILURE);
-      }
+    for (i = 0; i < threads; i++) flush_overlaps(&outbuf[i]);
+    elapsed = MPI_Wtime() - start_time;
+    fprintf(stderr, "Node %d: %lld %s in %.1fs (%.0f per second, %d at a time on %d thread%s)\n", mpirank,
+            probes_run, (suffix_link != NULL) ? "reads linked" : "suffix probes", elapsed,
+            (elapsed > 0.0) ? probes_run / elapsed : 0.0, probes, threads, (threads == 1) ? "" : "s");
+
+    if (sorted_map != NULL) munmap(sorted_map, sorted_map_size);
+
+    fprintf(stderr, "Node %d: %lld overlap searches passed to other nodes\n", mpirank, remote_hops);
+    if (cache_key != NULL) {
+      long long misses = rma ? rma_fetches : remote_hops;
+
+      fprintf(stderr, "Node %d: found %lld cells in the cache and went to other nodes %lld times"
+              " (%.1f%% hits); %lld searches finished in it rather than passed on\n", mpirank,
+              cache_hits, misses, (cache_hits+misses > 0) ? 100.0 * cache_hits / (cache_hits+misses) : 0.0,
+              cache_finished);
+    }
+    if ((rma || (cache_cells > 0)) && (cluster_size > 1)) MPI_Win_unlock_all(trie_win);
+    if (rma && (cluster_size > 1)) {
+      fprintf(stderr, "Node %d: fetched %lld cells from other nodes in %lld round trips"
+              " (%.1fus a round trip, %.2fus a cell)\n", mpirank, rma_fetches, rma_rounds,
+              (rma_rounds > 0) ? 1e6 * rma_wait / rma_rounds : 0.0,
+              (rma_fetches > 0) ? 1e6 * rma_wait / rma_fetches : 0.0);
     }
-
     time(&curtime); fprintf(stderr, "Program group %d of %d complete at %s",
-                             mpirank/cluster_size, mpisize/cluster_size, ctime(&curtime));
+                             cluster_index, clusters, ctime(&curtime));
     shut_down_other_nodes();
     fflush(overlaps);
 
   } else {
     /*  ALL OTHER PROCESSORS RUN AN ACCEPT/DISPATCH LOOP FOR REMOTE PROCEDURE CALLS... */
-    // (currently single-threaded.  An MPI guru could write this better.)
-
-    // Also it is VERY IMPORTANT to note that Node 0 does *not* run a copy of
-    // this dispatcher.  (because it is single-threaded too.)  Would be nice if
-    // that option were available, eg to allow callbacks.
 
-    // One optimisation trick planned for the far future...  if A calls B and B calls C,
-    // then C could pass the result back directly to A, allowing B to return to its
-    // displatch loop and accept more commands.  Which will be fine if it's always A
-    // that initiates certain types of call... - just need to be careful with
-    // specifying 'MPI_ANY_SOURCE' rather than 'caller'.
-
-    //INDEX index;
-    //CELL read_value;
-    long longvalue;
-    MPI_Status status;
+    // Searches are passed on without waiting for a reply, so if A passes one to B
+    // which passes it to C, C prints the result itself and B has long since gone
+    // back to its dispatch loop.  The base rank runs the same dispatcher, in case a
+    // search is ever passed back to it.
 
+    // Thread 0 receives the requests and the other threads, if any, carry them out.  With -rma
+    // the base rank fetches what it needs from our chunk itself, and we only have to keep
+    // it open until we are told to exit.
     //time(&curtime); fprintf(stderr, "\nSlave %d starting at %s", mpirank, ctime(&curtime));
-    // ultimately would like to run 16 listeners in parallel...
-    for (;;) {
-      int caller, done = FALSE;
-
-      // Accept an RPC request.  Get the command code.
-      MPI_Recv(&longvalue, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-      caller = status.MPI_SOURCE;
-
-      /*
-       * Check the tag of the received message and dispatch accordingly
-       */
-      if (status.MPI_TAG == TAG_LOCATE_OVERLAPS) {  // CALL locate_overlaps()
-	accept_locate_overlaps(mpirank, longvalue, status);
-
-      } else if (status.MPI_TAG == TAG_PRINT_OVERLAPS) {  // CALL print_overlaps()
-	accept_print_overlaps(mpirank, longvalue, status);
+    if (rma) {
+      long value;
 
-      } else if (status.MPI_TAG == TAG_EXIT_PROGRAM) {  // Kill clients
-        //fprintf(stderr, "Node %d asked to exit\n", mpirank);
-        //MPI_Send(&longvalue, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD); // Acknowlege
-        //fprintf(stderr, "Node %d exit acknowleged\n", mpirank);
-        done = TRUE;
-
-      } else {
-        // UNKNOWN - CODING ERROR?
+      MPI_Recv(&value, sizeof(value), MPI_BYTE, cluster_base, TAG_EXIT_PROGRAM, MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+    } else {
+#pragma omp parallel num_threads(threads)
+      {
+        if (omp_get_thread_num() == 0) {
+          run_network();
+        } else {
+          handle_requests();
+        }
       }
-
-      if (done) break;
+      omp_destroy_lock(&task_lock);
     }
     //fprintf(stderr, "Node %d exiting cleanly.  local base = %lld\n",
-    //	    mpirank, (mpirank%cluster_size) * CHUNKSIZE);
+    //	    mpirank, local_base);
 
     if (overlaps) {
+      for (i = 0; i < threads; i++) flush_overlaps(&outbuf[i]);
       rc = fclose(/* output */overlaps); overlaps = NULL;
       if (rc == EOF) {
         fprintf(stderr, "findoverlaps[%d]: Error closing %s-ovl-%05d.afg - %s\n",
@@ -870,12 +2004,17 @@ int main(int argc, char **argv)
 
   }
 
+  if (rma || (cache_cells > 0)) MPI_Win_free(&trie_win);
   if (memory_mapped) {
     fprintf(stderr, "findoverlaps[%d]: unmapping %s-edges (%ld bytes)\n",
              mpirank, argv[1], segment_size);
     rc = munmap(trie_cell, segment_size);
     fprintf(stderr, "findoverlaps[%d]: Error unmapping %s-edges - %s\n",
             mpirank, argv[1], strerror(errno));
+  } else if (node_shared) {
+    MPI_Win_free(&node_win);
+  } else if (hugepage_bytes > 0) {
+    munmap(trie_cell, hugepage_bytes);
   } else if (trie_cell != NULL) free(trie_cell);
   trie_cell = NULL;
 
@@ -7,6 +7,11 @@
 #include <omp.h>
 #include <ctype.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include <assert.h>
 
@@ -19,8 +24,6 @@ static FILE *duplicates = NULL;
 static FILE *rejects = NULL;
 static FILE *read_file = NULL;
 static FILE *read_index = NULL;
-static FILE *trie_file = NULL;
-static FILE *sorted_and_unique_reads = NULL;
 
 #define GBs 4L
 
@@ -30,12 +33,190 @@ typedef unsigned long long INDEX;
 #define ENDS_WORD (1ULL<<63ULL)
 #define EDGE_MASK (ENDS_WORD-1UL)
 
+#ifndef EDGE_BITS
+#define EDGE_BITS 64
+#endif
+
+/* With TAILS, an edge may instead point at a tail cell holding the rest of a
+   single read, 2 bits per base: see make_tail().  Node numbers lose a bit. */
+#ifndef TAILS
+#define TAILS 0
+#endif
+#define TAIL_EDGE (1ULL<<62ULL)
+
+#if EDGE_BITS == 64
+
+typedef EDGE STORED_EDGE;
+#define EDGE_LIMIT EDGE_MASK
+#define PACK_EDGE(v) (v)
+#define UNPACK_EDGE(e) (e)
+#define TAIL_WORD_BITS 63
+
+#elif EDGE_BITS == 32
+
+typedef unsigned int STORED_EDGE;
+#define STORED_LEAF (1U<<31)
+#define STORED_TAIL (1U<<30)
+#define EDGE_LIMIT ((EDGE) (STORED_LEAF-1U))
+#define TAIL_WORD_BITS 31
+#if TAILS
+#define PACK_EDGE(v) ((STORED_EDGE) (((v) & ENDS_WORD) ? (STORED_LEAF | ((v) & EDGE_LIMIT)) : \
+                     ((v) & TAIL_EDGE) ? (STORED_TAIL | ((v) & NODE_LIMIT)) : (v)))
+#define UNPACK_EDGE(e) (((e) & STORED_LEAF) ? (ENDS_WORD | (EDGE) ((e) & ~STORED_LEAF)) : \
+                        ((e) & STORED_TAIL) ? (TAIL_EDGE | (EDGE) ((e) & ~STORED_TAIL)) : (EDGE) (e))
+#else
+#define PACK_EDGE(v) ((STORED_EDGE) (((v) & ENDS_WORD) ? (STORED_LEAF | ((v) & EDGE_LIMIT)) : (v)))
+#define UNPACK_EDGE(e) (((e) & STORED_LEAF) ? (ENDS_WORD | (EDGE) ((e) & ~STORED_LEAF)) : (EDGE) (e))
+#endif
+
+#elif EDGE_BITS == 40
+
+typedef EDGE STORED_EDGE;
+#define EDGE_LIMIT ((1ULL<<39ULL)-1ULL)
+#define TAIL_WORD_BITS 39
+#define PACK_EDGE(v) (v)
+#define UNPACK_EDGE(e) (e)
+
+#else
+#error EDGE_BITS must be 32, 40 or 64
+#endif
+
+#ifndef EDGES_PER_CELL
+#define EDGES_PER_CELL 5
+#endif
+#if (EDGES_PER_CELL != 4) && (EDGES_PER_CELL != 5)
+#error EDGES_PER_CELL must be 4 or 5
+#endif
+
+#if TAILS
+#define NODE_LIMIT (EDGE_LIMIT >> 1)
+#define TAIL_BASES (((EDGES_PER_CELL - 1) * TAIL_WORD_BITS - 8) / 2)
+#else
+#define NODE_LIMIT EDGE_LIMIT
+#endif
+
+#if EDGE_BITS == 40
+typedef struct cell
+{
+   unsigned char edge[EDGES_PER_CELL][5];
+} CELL;
+
+static EDGE get_edge40 (unsigned char *p)
+{
+   EDGE e = (EDGE) p[0] | ((EDGE) p[1] << 8) | ((EDGE) p[2] << 16) |
+            ((EDGE) p[3] << 24) | ((EDGE) p[4] << 32);
+
+   if (e & (1ULL << 39)) return ENDS_WORD | (e & EDGE_LIMIT);
+   if (TAILS && (e & (1ULL << 38))) return TAIL_EDGE | (e & NODE_LIMIT);
+   return e;
+}
+
+static void set_edge40 (unsigned char *p, EDGE v)
+{
+   if (v & ENDS_WORD) v = (1ULL << 39) | (v & EDGE_LIMIT);
+   else if (v & TAIL_EDGE) v = (1ULL << 38) | (v & NODE_LIMIT);
+   p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; p[4] = v >> 32;
+}
+
+#define GET_CELL_EDGE(index, c) get_edge40 (trie_cell[index].edge[c])
+#define SET_CELL_EDGE(index, c, v) set_edge40 (trie_cell[index].edge[c], v)
+#else
 typedef struct cell
 {
-   EDGE edge[5];
+   STORED_EDGE edge[EDGES_PER_CELL];
 } CELL;
+
+#define GET_CELL_EDGE(index, c) UNPACK_EDGE (trie_cell[index].edge[c])
+#define SET_CELL_EDGE(index, c, v) (trie_cell[index].edge[c] = PACK_EDGE (v))
+#endif
 CELL *trie_cell;
 
+#if EDGES_PER_CELL == 4
+typedef struct nedge
+{
+   INDEX parent;
+   STORED_EDGE child;
+   struct nedge *next;
+} NEDGE;
+
+static NEDGE **nedge_hash = NULL;
+static long nedge_buckets = 0L, nedge_count = 0L;
+
+#define NEDGE_HASH(parent) ((long) (((parent) * 0x9E3779B97F4A7C15ULL) % (EDGE) nedge_buckets))
+
+static void nedge_rehash (long buckets)
+{
+   NEDGE **old = nedge_hash, *e, *next;
+   long i, old_buckets = nedge_buckets;
+
+   nedge_hash = calloc (buckets, sizeof (NEDGE *));
+   if (nedge_hash == NULL) {
+      fprintf (stderr, "maketrie: out of memory for the N edge table\n");
+      exit (EXIT_FAILURE);
+   }
+   nedge_buckets = buckets;
+   for (i = 0; i < old_buckets; i++) {
+      for (e = old[i]; e; e = next) {
+         next = e->next;
+         e->next = nedge_hash[NEDGE_HASH (e->parent)];
+         nedge_hash[NEDGE_HASH (e->parent)] = e;
+      }
+   }
+   free (old);
+}
+
+static volatile STORED_EDGE *nedge_slot (INDEX parent, int create)
+{
+   NEDGE *e = NULL;
+
+#pragma omp critical (nedges)
+   {
+      if (nedge_buckets) {
+         for (e = nedge_hash[NEDGE_HASH (parent)]; e; e = e->next) {
+            if (e->parent == parent) break;
+         }
+      }
+      if ((e == NULL) && create) {
+         if (nedge_count >= nedge_buckets) nedge_rehash (nedge_buckets ? nedge_buckets * 2 : 65536L);
+         e = malloc (sizeof (NEDGE));
+         if (e == NULL) {
+            fprintf (stderr, "maketrie: out of memory for the N edge table\n");
+            exit (EXIT_FAILURE);
+         }
+         e->parent = parent;
+         e->child = 0;
+         e->next = nedge_hash[NEDGE_HASH (parent)];
+         nedge_hash[NEDGE_HASH (parent)] = e;
+         nedge_count++;
+      }
+   }
+   return (e == NULL) ? NULL : &e->child;
+}
+
+static EDGE nedge_get (INDEX parent)
+{
+   volatile STORED_EDGE *slot = nedge_slot (parent, FALSE);
+   STORED_EDGE stored;
+
+   if (slot == NULL) return 0LL;
+   stored = *slot;
+   return UNPACK_EDGE (stored);
+}
+
+static void nedge_set (INDEX parent, EDGE v)
+{
+   *nedge_slot (parent, TRUE) = PACK_EDGE (v);
+}
+
+#define GET_EDGE(index, c) (((c) == _N_) ? nedge_get (index) : GET_CELL_EDGE (index, c))
+#define SET_EDGE(index, c, v) (((c) == _N_) ? nedge_set (index, v) : (void) (SET_CELL_EDGE (index, c, v)))
+#else
+#define GET_EDGE(index, c) GET_CELL_EDGE (index, c)
+#define SET_EDGE(index, c, v) SET_CELL_EDGE (index, c, v)
+#endif
+
+#define TRIE_MAGIC "TRIE"
+
 static INDEX MAX_SIZE = ((INDEX) 0L);
 
 #define ROOT_CELL ((INDEX)1L)
@@ -52,6 +233,67 @@ static CELL empty;
 
 char *trt = "ACGTN";
 
+static int letter_code (int c)
+{
+   if (c == 'A') return _A_;
+   if (c == 'C') return _C_;
+   if (c == 'G') return _G_;
+   if (c == 'T') return _T_;
+   return _N_;
+}
+
+#if TAILS
+/* A tail cell is word 0 = ENDS_WORD | read number, then the remaining words
+   as ENDS_WORD | TAIL_WORD_BITS bits of payload: an 8-bit base count followed
+   by the bases, 2 bits each.  Every word looks like a leaf, so code that only
+   relocates node edges leaves tail cells alone. */
+static int tail_length (char *s)
+{
+   int n = 0;
+
+   for (; (*s != '\0') && (*s != '\n') && (*s != '\r'); s++) {
+      if ((letter_code (*s) == _N_) || (++n > TAIL_BASES)) return 0;
+   }
+   return n;
+}
+
+static void make_tail (INDEX cell, char *s, int n, long read_number)
+{
+   EDGE word[EDGES_PER_CELL];
+   int i, bit;
+
+   memset (word, 0, sizeof (word));
+   word[0] = read_number;
+   for (bit = 0; bit < 8 + 2 * n; bit++) {
+      int v = (bit < 8) ? (n >> bit) : (letter_code (s[(bit - 8) / 2]) >> ((bit - 8) & 1));
+
+      if (v & 1) word[1 + bit / TAIL_WORD_BITS] |= 1ULL << (bit % TAIL_WORD_BITS);
+   }
+   for (i = 0; i < EDGES_PER_CELL; i++) SET_CELL_EDGE (cell, i, ENDS_WORD | word[i]);
+}
+
+static int read_tail (INDEX cell, char *s, long *read_number)
+{
+   EDGE word[EDGES_PER_CELL];
+   int i, n = 0, bit;
+
+   for (i = 0; i < EDGES_PER_CELL; i++) word[i] = GET_CELL_EDGE (cell, i) & EDGE_MASK;
+   *read_number = word[0];
+   for (bit = 0; bit < 8; bit++) n |= ((word[1] >> bit) & 1) << bit;
+   for (i = 0; i < n; i++) {
+      int b = 8 + 2 * i, code;
+
+      code = (word[1 + b / TAIL_WORD_BITS] >> (b % TAIL_WORD_BITS)) & 1;
+      b++;
+      code |= ((word[1 + b / TAIL_WORD_BITS] >> (b % TAIL_WORD_BITS)) & 1) << 1;
+      s[i] = trt[code];
+   }
+   s[n] = '\0';
+   return n;
+}
+
+#endif
+
 static long freq[256];
 static long letters = 0L;
 static int seq = 0, dups = 0;
@@ -60,6 +302,22 @@ static int seq = 0, dups = 0;
 
 static long length[MAX_LINE];
 static int read_length = 0;
+static int sorted_fd = -1;      /* -sorted, written in place by every rank */
+
+/* -sorted starts with this header, followed by one record per unique read */
+#define SORTED_MAGIC "SRT2"
+typedef struct {
+   char magic[4];
+   unsigned int read_length;
+   unsigned long long reads;
+   unsigned int record_bytes;
+   unsigned int spare[3];
+} SORTEDHEADER;
+#define SORTED_HEADER_BYTES ((off_t) sizeof (SORTEDHEADER))
+#define SORTED_RECORD_BYTES(len) (8 + ((len) + 3) / 4 + ((len) + 7) / 8)
+static char sorted_name[MAX_LINE];
+static int sorted_record_bytes;
+static long sorted_written = 0L;
 
 #define CORES_PER_NODE 16ULL
 
@@ -75,14 +333,138 @@ static long long TASKS_PER_NODE, PROCESSORS_PER_NODE;
 #define TAG_WRITE_READ 5
 #define TAG_EXIT_PROGRAM 6
 
-#define TAG_ADD_READ 7
-#define TAG_GET_NEXT_FREE_EDGE 8
+#define TAG_ADD_READ_BATCH 7
+#define TAG_LEASE_EDGES 8
 #define TAG_OUTPUT_DUPINFO 9
-#define TAG_OUTPUT_READ 10
-#define TAG_WALK_AND_PRINT_TRIE_INTERNAL 13
+#define TAG_COUNT_SORTED 10
+#define TAG_WRITE_SORTED 13
 #define TAG_DUMP_TRIE 14
+#define TAG_FLUSH 15
+
+/* Rank r holds cells chunk_base[r] .. chunk_base[r + 1] - 1, as many as fit in
+   its own memory.  When every rank has the same amount the owner of a cell is
+   found by division, otherwise by a binary search of the table. */
+static long long CHUNKSIZE;     /* cells held on this rank */
+static INDEX *chunk_base, chunk_uniform;
+
+static int rank_of (INDEX index)
+{
+   int lo = 0, hi = mpisize - 1;
+
+   if (index >= chunk_base[mpisize]) return mpisize;
+   if (chunk_uniform) return index / chunk_uniform;
+   while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+
+      if (chunk_base[mid] <= index) lo = mid;
+      else hi = mid - 1;
+   }
+   return lo;
+}
+
+/* Every rank learns how many cells each of the others holds. */
+static void set_chunk_table (void)
+{
+   int r;
+
+   chunk_base = malloc ((mpisize + 1) * sizeof (INDEX));
+   if (chunk_base == NULL) {
+      fprintf (stderr, "maketrie: rank %d cannot allocate the chunk table\n", mpirank);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   MPI_Allgather (&CHUNKSIZE, 1, MPI_LONG_LONG, chunk_base + 1, 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+   chunk_base[0] = 0;
+   chunk_uniform = CHUNKSIZE;
+   for (r = 1; r <= mpisize; r++) {
+      if (chunk_base[r] != (INDEX) CHUNKSIZE) chunk_uniform = 0;
+      chunk_base[r] += chunk_base[r - 1];
+   }
+}
+
+/* With -map, trie_cell[] is a MAP_SHARED window onto this rank's part of the
+   -edges file, so the trie is on disk the moment it is built and dump_trie ()
+   has nothing to copy.  Until the chunk table says where that part is, the
+   address space is only reserved. */
+static int map_trie = FALSE;
+static int trie_fd = -1;
+static char *map_base = NULL;
+static size_t map_length;
+
+static CELL *chunk_alloc (void)
+{
+   if (!map_trie) return calloc (CHUNKSIZE, sizeof (CELL));
+   /* one page spare, since our part of the file need not start on a page */
+   map_length = CHUNKSIZE * sizeof (CELL) + getpagesize ();
+   map_base = mmap (NULL, map_length, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (map_base == MAP_FAILED) {
+      map_base = NULL;
+      return NULL;
+   }
+   return (CELL *) map_base;
+}
+
+static void chunk_free (void)
+{
+   if (map_trie) {
+      if (map_base) munmap (map_base, map_length);
+      map_base = NULL;
+      if (trie_fd >= 0) close (trie_fd);
+      trie_fd = -1;
+   } else if (trie_cell != NULL) {
+      free (trie_cell);
+   }
+   trie_cell = NULL;
+}
+
+/* Rank 0 creates the file at its full size, which costs nothing as it is
+   sparse until cells are written, then every rank maps its own part of it
+   over the address space it reserved. */
+static void map_trie_file (char *filename)
+{
+   off_t start = (off_t) chunk_base[mpirank] * sizeof (CELL);
+   off_t page = start & ~((off_t) getpagesize () - 1);
+
+   if (mpirank == 0) {
+      trie_fd = open (filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if ((trie_fd >= 0)
+          && (ftruncate (trie_fd, (off_t) chunk_base[mpisize] * sizeof (CELL)) != 0)) {
+         close (trie_fd);
+         trie_fd = -1;
+      }
+   }
+   MPI_Barrier (MPI_COMM_WORLD);
+   if (mpirank != 0) trie_fd = open (filename, O_RDWR);
+   if ((trie_fd < 0)
+       || (mmap (map_base, map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 trie_fd, page) == MAP_FAILED)) {
+      fprintf (stderr, "maketrie[%d]: Cannot map trie file %s - %s\n", mpirank,
+               filename, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   trie_cell = (CELL *) (map_base + (start - page));
+   fprintf (stderr, "Node %d: building trie directly in %s at offset %lld\n", mpirank,
+            filename, (long long) start);
+}
 
-static long long CHUNKBITS, CHUNKSIZE, CHUNKMASK;
+#define LOCAL(index) ((index) - chunk_base[mpirank])
+#define CHUNK_START chunk_base[mpirank]
+#define CHUNK_END (chunk_base[mpirank + 1] - 1)
+
+#define BATCH_READS 16384
+#define BATCH_BYTES (4L << 20)
+#define LEASE_CELLS 65536ULL
+#define SLAB_CELLS 4096ULL
+#define SLAB_MIN_CELLS 16ULL
+
+static int build_threads = 1;
+static int prefix_bases = 0;
+static INDEX lease_next = 0, lease_end = 0;
+static int lease_rank = 1;
+#if EDGE_BITS != 40
+static INDEX slab_next = 0, slab_end = 0;
+#pragma omp threadprivate (slab_next, slab_end)
+#endif
 
 static void shut_down_other_nodes (void)
 {
@@ -94,7 +476,7 @@ static void shut_down_other_nodes (void)
       if (target_rank != mpirank) {
          MPI_Send (&value, 1, MPI_LONG, target_rank, TAG_EXIT_PROGRAM,
                    MPI_COMM_WORLD);
-         MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
+         MPI_Recv (&value, 1, MPI_LONG, target_rank, 0,
                    MPI_COMM_WORLD, &status);
       }
    }
@@ -105,28 +487,10 @@ static void send_bytes (int dest, void *memp, long bytes)
    MPI_Send (memp, bytes, MPI_BYTE, dest, TAG_SEND_RAW_MEM, MPI_COMM_WORLD);
 }
 
-static void remote_walk_and_print_trie_internal (int target_rank, char *s,
-                                                 EDGE edge, int len)
-{
-   MPI_Status status;
-   long value = 0L;
-   long stringlength;
-
-   stringlength = strlen (s) + 1;
-   MPI_Send (&value, 1, MPI_LONG, target_rank,
-             TAG_WALK_AND_PRINT_TRIE_INTERNAL, MPI_COMM_WORLD);
-   MPI_Send (&stringlength, 1, MPI_LONG, target_rank, TAG_DATA,
-             MPI_COMM_WORLD);
-   send_bytes (target_rank, s, stringlength);
-   MPI_Send (&edge, 1, MPI_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   MPI_Send (&len, 1, MPI_INT, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
-}
-
+/* Every rank writes its own part of the trie at once, so this only asks the
+   target to join in; dump_trie () does the waiting. */
 static void remote_dump_trie (int target_rank, char *filename)
 {
-   MPI_Status status;
    long value = 0L;
    long stringlength;
 
@@ -135,8 +499,6 @@ static void remote_dump_trie (int target_rank, char *filename)
    MPI_Send (&stringlength, 1, MPI_LONG, target_rank, TAG_DATA,
              MPI_COMM_WORLD);
    send_bytes (target_rank, filename, stringlength);
-   MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
 }
 
 static void remote_setread (int target_rank, INDEX index, CELL value)
@@ -148,10 +510,9 @@ static void remote_setread (int target_rank, INDEX index, CELL value)
    MPI_Send (&dummy, 1, MPI_LONG, target_rank, TAG_WRITE_READ,
              MPI_COMM_WORLD);
    MPI_Send (&index, 1, MPI_LONG_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   assert (sizeof (value.edge[0]) == sizeof (long));
-   MPI_Send (&value.edge, sizeof (value.edge) / sizeof (value.edge[0]),
-             MPI_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
+   MPI_Send (&value, sizeof (CELL), MPI_BYTE, target_rank, TAG_DATA,
+             MPI_COMM_WORLD);
+   MPI_Recv (&value, 1, MPI_LONG, target_rank, 0, MPI_COMM_WORLD,
              &status);
 }
 
@@ -162,20 +523,17 @@ static void remote_getread (int target_rank, INDEX index, CELL * valuep)
 
    MPI_Send (&dummy, 1, MPI_LONG, target_rank, TAG_READ_READ, MPI_COMM_WORLD);
    MPI_Send (&index, 1, MPI_LONG_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   assert (sizeof (valuep->edge[0]) == sizeof (long));
-   MPI_Recv (valuep, sizeof (valuep->edge) / sizeof (valuep->edge[0]),
-             MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+   MPI_Recv (valuep, sizeof (CELL), MPI_BYTE, target_rank, 0, MPI_COMM_WORLD,
+             &status);
 }
 
 static void setread (INDEX index, CELL value)
 {
 int target_rank;
 
-   target_rank = index >> CHUNKBITS;
+   target_rank = rank_of (index);
    if (target_rank == mpirank) {
-      int i;
-
-      for (i = 0; i < 5; i++) trie_cell[index & CHUNKMASK].edge[i] = value.edge[i];
+      trie_cell[LOCAL (index)] = value;
    } else {
       if (target_rank < mpirank) {
          fprintf (stderr,
@@ -202,11 +560,9 @@ static void getread (INDEX index, CELL * valuep)
 {
 int target_rank;
 
-   target_rank = index >> CHUNKBITS;
+   target_rank = rank_of (index);
    if (target_rank == mpirank) {
-      int i;
-
-      for (i = 0; i < 5; i++) valuep->edge[i] = trie_cell[index & CHUNKMASK].edge[i];
+      *valuep = trie_cell[LOCAL (index)];
    } else {
       if (target_rank < mpirank) {
          fprintf (stderr,
@@ -232,11 +588,62 @@ int target_rank;
 static int add_read (char *s, EDGE edge, long read_number, int len);
 static INDEX get_next_free_edge (void);
 
+#if TAILS
+/* Turn a (local) tail cell back into an ordinary node holding the first base
+   of the tail, with the rest moved into spare.  spare is only used when more
+   than one base was left; if it is not local the caller must add the rest of
+   the read there itself. */
+static void tail_unfold (INDEX cell, char *tail, int n, long read_number, INDEX spare)
+{
+   int d = letter_code (tail[0]);
+
+   memset (&trie_cell[cell], 0, sizeof (CELL));
+   if (n == 1) {
+      SET_CELL_EDGE (cell, d, ENDS_WORD | read_number);
+   } else if (rank_of (spare) == mpirank) {
+      make_tail (LOCAL (spare), tail + 1, n - 1, read_number);
+      SET_CELL_EDGE (cell, d, TAIL_EDGE | spare);
+   } else {
+      SET_CELL_EDGE (cell, d, spare);
+   }
+}
+
+/* A second read has arrived at a tail: split one base off it.  Called again
+   at each level until the two reads diverge. */
+static void tail_push_down (INDEX parent, int c)
+{
+   char tail[TAIL_BASES + 1];
+   INDEX cell = GET_EDGE (parent, c) & NODE_LIMIT, spare = 0;
+   long read_number;
+   int n = read_tail (LOCAL (cell), tail, &read_number), i;
+
+   if (n > 1) {
+      spare = get_next_free_edge ();
+      if (spare >= MAX_SIZE) {
+         fprintf (stderr,
+                  "Ran out of free edges after %d reads (last_used_edge = %lld, MAX_SIZE = %lld)\n",
+                  seq, spare, MAX_SIZE);
+         shut_down_other_nodes ();
+         MPI_Finalize ();
+         exit (EXIT_FAILURE);
+      }
+   }
+   tail_unfold (LOCAL (cell), tail, n, read_number, spare);
+   SET_EDGE (parent, c, cell);
+   if ((n > 1) && (rank_of (spare) != mpirank)) {
+      /* these bases will be counted again by the rank that stores them */
+      for (i = 1; i < n; i++) freq[(int) tail[i]]--;
+      letters -= n - 1;
+      (void) add_read (tail + 1, spare, read_number, 1);
+   }
+}
+#endif
+
 static int local_add_read (char *s, EDGE edge, long read_number, int len)
 {
    int c;
 
-   assert ((edge >> CHUNKBITS) == mpirank);
+   assert (rank_of (edge) == mpirank);
    assert ((*s != '\0') && (*s != '\n') && (*s != '\r'));
 
    c = *s++;
@@ -250,9 +657,13 @@ static int local_add_read (char *s, EDGE edge, long read_number, int len)
    else if (c == 'T') c = _T_;
    else c = _N_;
 
+#if TAILS
+   if (GET_EDGE (LOCAL (edge), c) & TAIL_EDGE) tail_push_down (LOCAL (edge), c);
+#endif
+
    if ((*s == '\0') || (*s == '\n') || (*s == '\r')) {
-      if (trie_cell[edge & CHUNKMASK].edge[c] & ENDS_WORD) {
-         long original_read = trie_cell[edge & CHUNKMASK].edge[c] & EDGE_MASK;
+      if (GET_EDGE (LOCAL (edge), c) & ENDS_WORD) {
+         long original_read = GET_EDGE (LOCAL (edge), c) & EDGE_MASK;
 
          fprintf (duplicates, "%ld:0 %ld\n", original_read, read_number);
          if (ferror (duplicates)) {
@@ -265,20 +676,18 @@ static int local_add_read (char *s, EDGE edge, long read_number, int len)
          }
          dups++;
       } else {
-         assert ((trie_cell[edge & CHUNKMASK].edge[c] & EDGE_MASK) == 0);
-         trie_cell[edge & CHUNKMASK].edge[c] = (ENDS_WORD | read_number);
+         assert ((GET_EDGE (LOCAL (edge), c) & EDGE_MASK) == 0);
+         SET_EDGE (LOCAL (edge), c, ENDS_WORD | read_number);
       }
 
       return len + 1;
    }
 
-   if (trie_cell[edge & CHUNKMASK].edge[c] == 0LL) {
+   if (GET_EDGE (LOCAL (edge), c) == 0LL) {
 
       INDEX new_edge = get_next_free_edge ();
 
-      setread (new_edge, empty);
-
-      trie_cell[edge & CHUNKMASK].edge[c] = new_edge;
+      SET_EDGE (LOCAL (edge), c, new_edge);
       if (new_edge >= MAX_SIZE) {
          fprintf (stderr,
                   "Ran out of free edges after %d reads (last_used_edge = %lld, MAX_SIZE = %lld)\n",
@@ -287,383 +696,1834 @@ static int local_add_read (char *s, EDGE edge, long read_number, int len)
          MPI_Finalize ();
          exit (EXIT_FAILURE);
       }
-   } else {
-
+#if TAILS
+      {
+         int tail_len = tail_length (s);
+
+         if ((tail_len > 0) && (rank_of (new_edge) == mpirank)) {
+            make_tail (LOCAL (new_edge), s, tail_len, read_number);
+            SET_EDGE (LOCAL (edge), c, TAIL_EDGE | new_edge);
+            for (; (*s != '\0') && (*s != '\n') && (*s != '\r'); s++) freq[(int) *s]++;
+            letters += tail_len;
+            return len + 1 + tail_len;
+         }
+      }
+#endif
+   } else {
+
+   }
+   return add_read (s, GET_EDGE (LOCAL (edge), c), read_number,
+                    len + 1);
+
+}
+static void remote_lease_edges (int target_rank, INDEX count, INDEX *first,
+                                INDEX *last)
+{
+   MPI_Status status;
+   long value = 0L;
+
+   assert (target_rank > mpirank);
+   MPI_Send (&value, 1, MPI_LONG, target_rank, TAG_LEASE_EDGES,
+             MPI_COMM_WORLD);
+   assert (sizeof (INDEX) == sizeof (long long));
+   MPI_Send (&count, 1, MPI_LONG_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
+   MPI_Recv (first, 1, MPI_LONG_LONG, target_rank, 0, MPI_COMM_WORLD,
+             &status);
+   MPI_Recv (last, 1, MPI_LONG_LONG, target_rank, 0, MPI_COMM_WORLD,
+             &status);
+   MPI_Recv (&value, 1, MPI_LONG, target_rank, 0, MPI_COMM_WORLD,
+             &status);
+}
+
+typedef struct outbatch
+{
+   char *buf[2];
+   long used, count[2];
+   int cur;
+   MPI_Request req[2], count_req[2];
+} OUTBATCH;
+static OUTBATCH *outbatch = NULL;
+
+static void send_batch (int target_rank)
+{
+   OUTBATCH *b = &outbatch[target_rank];
+
+   if (b->used == 0L) return;
+   b->count[b->cur] = b->used;
+   MPI_Isend (&b->count[b->cur], 1, MPI_LONG, target_rank, TAG_ADD_READ_BATCH,
+              MPI_COMM_WORLD, &b->count_req[b->cur]);
+   MPI_Isend (b->buf[b->cur], b->used, MPI_BYTE, target_rank, TAG_DATA,
+              MPI_COMM_WORLD, &b->req[b->cur]);
+   b->cur ^= 1;
+   MPI_Wait (&b->count_req[b->cur], MPI_STATUS_IGNORE);
+   MPI_Wait (&b->req[b->cur], MPI_STATUS_IGNORE);
+   b->used = 0L;
+}
+
+static void flush_batches (void)
+{
+   int target_rank, i;
+
+   for (target_rank = mpirank + 1; target_rank < mpisize; target_rank++) {
+      send_batch (target_rank);
+      for (i = 0; i < 2; i++) {
+         MPI_Wait (&outbatch[target_rank].count_req[i], MPI_STATUS_IGNORE);
+         MPI_Wait (&outbatch[target_rank].req[i], MPI_STATUS_IGNORE);
+      }
+   }
+}
+
+static int remote_add_read (long target_rank, char *s, long edge,
+                            long read_number, int len)
+{
+   OUTBATCH *b = &outbatch[target_rank];
+   long stringlength, need;
+   char *p;
+
+   assert (target_rank > mpirank);
+   stringlength = strlen (s) + 1;
+   need = sizeof (EDGE) + sizeof (long) + sizeof (int) + stringlength;
+   if (b->buf[0] == NULL) {
+      b->buf[0] = malloc (BATCH_BYTES);
+      b->buf[1] = malloc (BATCH_BYTES);
+      if ((b->buf[0] == NULL) || (b->buf[1] == NULL)) {
+         fprintf (stderr, "maketrie: rank %d cannot allocate batch buffers for rank %ld\n",
+                  mpirank, target_rank);
+         shut_down_other_nodes ();
+         MPI_Finalize ();
+         exit (EXIT_FAILURE);
+      }
+   }
+   if (b->used + need > BATCH_BYTES) send_batch (target_rank);
+
+   p = b->buf[b->cur] + b->used;
+   memcpy (p, &edge, sizeof (EDGE));
+   p += sizeof (EDGE);
+   memcpy (p, &read_number, sizeof (long));
+   p += sizeof (long);
+   memcpy (p, &len, sizeof (int));
+   p += sizeof (int);
+   memcpy (p, s, stringlength);
+   b->used += need;
+
+   return len + stringlength - 1;
+}
+
+static void finish_adds (void)
+{
+   int target_rank;
+   long value = 0L;
+
+   flush_batches ();
+   for (target_rank = mpirank + 1; target_rank < mpisize; target_rank++) {
+      MPI_Send (&value, 1, MPI_LONG, target_rank, TAG_FLUSH, MPI_COMM_WORLD);
+   }
+   if ((mpirank != 0) && (mpirank == mpisize - 1)) {
+      MPI_Send (&value, 1, MPI_LONG, 0, TAG_ACK, MPI_COMM_WORLD);
+   }
+}
+
+static void lease_edges (INDEX count, INDEX *first, INDEX *last);
+static void accept_lease_edges (int caller)
+{
+   MPI_Status status;
+   INDEX count, first, last;
+
+   MPI_Recv (&count, 1, MPI_LONG_LONG, caller, MPI_ANY_TAG, MPI_COMM_WORLD,
+             &status);
+   lease_edges (count, &first, &last);
+   MPI_Send (&first, 1, MPI_LONG_LONG, caller, 0, MPI_COMM_WORLD);
+   MPI_Send (&last, 1, MPI_LONG_LONG, caller, 0, MPI_COMM_WORLD);
+}
+
+static void accept_add_read_batch (int myrank, long value, MPI_Status status)
+{
+   static char *buf = NULL;
+   static long size = 0L;
+   char *p;
+   int caller = status.MPI_SOURCE;
+
+   if (value > size) {
+      free (buf);
+      size = value;
+      buf = malloc (size);
+      if (buf == NULL) {
+         fprintf (stderr, "maketrie: rank %d cannot allocate %ld bytes for a batch\n",
+                  mpirank, value);
+         shut_down_other_nodes ();
+         MPI_Finalize ();
+         exit (EXIT_FAILURE);
+      }
+   }
+   MPI_Recv (buf, value, MPI_BYTE, caller, TAG_DATA, MPI_COMM_WORLD, &status);
+
+   for (p = buf; p < buf + value;) {
+      EDGE edge;
+      long read_number;
+      int len;
+
+      memcpy (&edge, p, sizeof (EDGE));
+      p += sizeof (EDGE);
+      memcpy (&read_number, p, sizeof (long));
+      p += sizeof (long);
+      memcpy (&len, p, sizeof (int));
+      p += sizeof (int);
+      assert (rank_of (edge) == mpirank);
+      (void) add_read (p, edge, read_number, len);
+      p += strlen (p) + 1;
+   }
+}
+
+static void dump_trie (char *filename);
+static void accept_dump_trie (int myrank, long value, MPI_Status status)
+{
+   char filename[MAX_LINE];
+   long stringlength;
+   int caller;
+
+   caller = status.MPI_SOURCE;
+   MPI_Recv (&stringlength, 1, MPI_LONG, caller, MPI_ANY_TAG,
+             MPI_COMM_WORLD, &status);
+   MPI_Recv (filename, stringlength, MPI_BYTE, caller, MPI_ANY_TAG,
+             MPI_COMM_WORLD, &status);
+   dump_trie (filename);
+}
+
+static void lease_edges (INDEX count, INDEX *first, INDEX *last)
+{
+   INDEX chunk_end = CHUNK_END;
+
+   if (rank_of (last_used_edge + (INDEX) 1) == mpirank) {
+      *first = last_used_edge + 1;
+      *last = *first + count - 1;
+      if (*last > chunk_end) *last = chunk_end;
+      last_used_edge = *last;
+   } else if (lease_rank >= mpisize) {
+      *first = *last = MAX_SIZE;
+   } else {
+      remote_lease_edges (lease_rank, count, first, last);
+      lease_rank = rank_of (*first);
+   }
+}
+
+static INDEX get_next_free_edge (void)
+{
+   if (rank_of (last_used_edge + (INDEX) 1) != mpirank) {
+      if ((lease_next == 0) || (lease_next > lease_end)) {
+         lease_edges ((LEASE_CELLS < (CHUNKSIZE >> 4)) ? LEASE_CELLS : (CHUNKSIZE >> 4),
+                      &lease_next, &lease_end);
+         if (lease_next >= MAX_SIZE) return MAX_SIZE;
+      }
+      return lease_next++;
+   } else
+      return ++last_used_edge;
+}
+
+static int add_read (char *s, EDGE edge, long read_number, int len)
+{
+   int len2;
+   long long int target_rank = rank_of (edge);
+
+   if (len == 0) {
+      assert (edge == ROOT_CELL);
+      if (read_number > EDGE_LIMIT) {
+         fprintf (stderr, "maketrie: too many READs! (%ld)  Limit is %lld\n",
+                  read_number, EDGE_LIMIT);
+         assert (read_number <= EDGE_LIMIT);
+      }
+      seq++;
+   }
+
+   if (target_rank == mpirank) {
+      len2 = local_add_read (s, edge, read_number, len);
+      if (len == 0) length[len2]++;
+      return len2;
+   } else {
+      return remote_add_read ((long) target_rank, s, edge, read_number, len);
+   }
+
+}
+
+#if EDGE_BITS != 40
+static INDEX threaded_next_free_edge (int *from_slab)
+{
+   INDEX chunk_end = CHUNK_END;
+
+   if (slab_next == 0 || slab_next > slab_end) {
+      /* Whatever is left of each thread's last slab is written out unused, so slabs
+         start small and grow with the trie, keeping the waste to about 1/64 of it. */
+      INDEX used = (last_used_edge >= CHUNK_START) ? last_used_edge - CHUNK_START : 0;
+      INDEX slab = used / (64 * build_threads), base;
+
+      if (slab < SLAB_MIN_CELLS) slab = SLAB_MIN_CELLS;
+      if (slab > SLAB_CELLS) slab = SLAB_CELLS;
+      base = __sync_fetch_and_add (&last_used_edge, slab) + 1;
+
+      if (base > chunk_end) {
+         INDEX new_edge;
+
+         *from_slab = FALSE;
+#pragma omp critical (mpi)
+         {
+            new_edge = get_next_free_edge ();
+         }
+         return new_edge;
+      }
+      slab_next = base;
+      slab_end = base + slab - 1;
+      if (slab_end > chunk_end) slab_end = chunk_end;
+   }
+   *from_slab = TRUE;
+   return slab_next;
+}
+
+#if TAILS
+static void threaded_tail_push_down (volatile STORED_EDGE *slot)
+{
+   char tail[TAIL_BASES + 1];
+   STORED_EDGE stored;
+   EDGE e;
+   INDEX cell, spare = 0;
+   long read_number;
+   int n, from_slab;
+
+#pragma omp critical (tails)
+   {
+      stored = *slot;
+      e = UNPACK_EDGE (stored);
+      if (e & TAIL_EDGE) {
+         cell = e & NODE_LIMIT;
+         n = read_tail (LOCAL (cell), tail, &read_number);
+         if (n > 1) {
+            spare = threaded_next_free_edge (&from_slab);
+            if (spare >= MAX_SIZE) {
+               fprintf (stderr,
+                        "Ran out of free edges after %d reads (last_used_edge = %lld, MAX_SIZE = %lld)\n",
+                        seq, spare, MAX_SIZE);
+#pragma omp critical (mpi)
+               {
+                  shut_down_other_nodes ();
+                  MPI_Finalize ();
+                  exit (EXIT_FAILURE);
+               }
+            }
+            if (from_slab) slab_next++;
+         }
+         tail_unfold (LOCAL (cell), tail, n, read_number, spare);
+         __sync_synchronize ();
+         *slot = PACK_EDGE (cell);
+         if ((n > 1) && (rank_of (spare) != mpirank)) {
+#pragma omp critical (mpi)
+            (void) add_read (tail + 1, spare, read_number, 1);
+         }
+      }
+   }
+}
+#endif
+
+static int threaded_add_read (char *s, long read_number)
+{
+   EDGE edge = ROOT_CELL, next, old;
+   volatile STORED_EDGE *slot;
+   STORED_EDGE stored;
+   int c, len = 0, from_slab;
+
+   for (;;) {
+      if (rank_of (edge) != mpirank) {
+         int len2;
+
+#pragma omp critical (mpi)
+         len2 = add_read (s, edge, read_number, len);
+         return len2;
+      }
+
+      c = *s++;
+      if (c == 'A') c = _A_;
+      else if (c == 'C') c = _C_;
+      else if (c == 'G') c = _G_;
+      else if (c == 'T') c = _T_;
+      else c = _N_;
+
+#if EDGES_PER_CELL == 4
+      if (c == _N_) slot = nedge_slot (LOCAL (edge), TRUE);
+      else
+#endif
+      slot = &trie_cell[LOCAL (edge)].edge[c];
+#if TAILS
+      stored = *slot;
+      if (UNPACK_EDGE (stored) & TAIL_EDGE) threaded_tail_push_down (slot);
+#endif
+
+      if ((*s == '\0') || (*s == '\n') || (*s == '\r')) {
+         long original_read;
+
+         for (;;) {
+            stored = *slot;
+            old = UNPACK_EDGE (stored);
+            if (old == 0LL) {
+               if (__sync_bool_compare_and_swap (slot, 0, PACK_EDGE (ENDS_WORD | read_number))) return len + 1;
+            } else if ((long) (old & EDGE_MASK) > read_number) {
+               if (__sync_bool_compare_and_swap (slot, PACK_EDGE (old), PACK_EDGE (ENDS_WORD | read_number))) {
+                  original_read = read_number;
+                  read_number = old & EDGE_MASK;
+                  break;
+               }
+            } else {
+               original_read = old & EDGE_MASK;
+               break;
+            }
+         }
+
+#pragma omp critical (duplicates)
+         {
+            fprintf (duplicates, "%ld:0 %ld\n", original_read, read_number);
+            if (ferror (duplicates)) {
+               fprintf (stderr,
+                        "\n\n************* add_read() (duplicates) failed, %s\n",
+                        strerror (errno));
+               shut_down_other_nodes ();
+               MPI_Finalize ();
+               exit (EXIT_FAILURE);
+            }
+            dups++;
+         }
+         return len + 1;
+      }
+
+      stored = *slot;
+      next = UNPACK_EDGE (stored);
+      if (next == 0LL) {
+         INDEX new_edge = threaded_next_free_edge (&from_slab);
+
+         if (new_edge >= MAX_SIZE) {
+            fprintf (stderr,
+                     "Ran out of free edges after %d reads (last_used_edge = %lld, MAX_SIZE = %lld)\n",
+                     seq, new_edge, MAX_SIZE);
+#pragma omp critical (mpi)
+            {
+               shut_down_other_nodes ();
+               MPI_Finalize ();
+               exit (EXIT_FAILURE);
+            }
+         }
+#if TAILS
+         {
+            int tail_len = from_slab ? tail_length (s) : 0;
+
+            if (tail_len > 0) {
+               make_tail (LOCAL (new_edge), s, tail_len, read_number);
+               stored = __sync_val_compare_and_swap (slot, 0, PACK_EDGE (TAIL_EDGE | new_edge));
+               if (stored == 0) {
+                  slab_next++;
+                  return len + 1 + tail_len;
+               }
+               memset (&trie_cell[LOCAL (new_edge)], 0, sizeof (CELL));
+               s--;
+               continue;
+            }
+         }
+#endif
+         stored = __sync_val_compare_and_swap (slot, 0, PACK_EDGE (new_edge));
+         next = UNPACK_EDGE (stored);
+         if (next == 0LL) {
+            next = new_edge;
+            if (from_slab) slab_next++;
+         }
+      }
+#if TAILS
+      if (next & TAIL_EDGE) {
+         s--;
+         continue;
+      }
+#endif
+      edge = next;
+      len++;
+   }
+}
+#else
+static int threaded_add_read (char *s, long read_number)
+{
+   return add_read (s, ROOT_CELL, read_number, 0);
+}
+#endif
+
+static void add_batch (char **line, long first_read, int count)
+{
+   int i;
+
+   if (build_threads <= 1) {
+      for (i = 0; i < count; i++) add_read (line[i], ROOT_CELL, first_read + i, 0);
+      return;
+   }
+
+   for (i = 0; i < count; i++) {
+      char *s;
+
+      for (s = line[i]; *s; s++) freq[(int) *s]++;
+      letters += s - line[i];
+      seq++;
+   }
+#pragma omp parallel for schedule(dynamic, 64)
+   for (i = 0; i < count; i++) {
+      int len = threaded_add_read (line[i], first_read + i);
+
+#pragma omp atomic
+      length[len]++;
+   }
+   if (last_used_edge > CHUNK_END) {
+      last_used_edge = CHUNK_END;
+   }
+}
+
+/* Rank 0's input is read and split into records by a separate I/O thread, which
+   fills one batch while the reads of the other are being inserted.  Only the
+   sequence lines are copied out of the read buffer, packed end to end, and the
+   -index offsets are written a batch at a time.
+
+   Gzipped input is read through zlib, and the offsets in -index are then
+   positions in the uncompressed text.  BGZF input (as written by bgzip) is a
+   series of independent gzip blocks of at most 64K, so several of those are
+   inflated at once, and -index holds BGZF virtual offsets instead: the file
+   offset of the block shifted up 16 bits, plus the offset within the block. */
+
+#define READ_BLOCK (4L << 20)
+
+typedef struct readbatch
+{
+   char *text;                  /* the sequences, each NUL-terminated */
+   char *seq[BATCH_READS];
+   int count;
+   int error_line;              /* input format error at this line, or 0 */
+   int read_errno;              /* read() failed, or 0 */
+   int last;                    /* no more batches follow this one */
+} READBATCH;
+
+static READBATCH readbatch[2];
+static int readbatch_full[2];
+static pthread_mutex_t readbatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readbatch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reader_thread;
+
+static char *reader_buf;
+static off_t *reader_start_offset; /* of each record of a batch, for -index */
+static long reader_have, reader_pos;
+static off_t reader_offset;     /* file offset of reader_buf[0] */
+static int reader_fd, reader_eof, reader_errno;
+static FILE *reader_file;
+static gzFile reader_gz;
+
+#define BGZF_BLOCK 65536L
+#define BGZF_BATCH 64
+
+static int bgzf;
+static unsigned char *bgzf_in;
+static off_t bgzf_offset;       /* file offset of the next block */
+static off_t *block_ustart, *block_offset;      /* blocks still in reader_buf */
+static long *block_length, blocks, block_first, block_space;
+
+static int is_bgzf (unsigned char *h)
+{
+   return (h[0] == 0x1f) && (h[1] == 0x8b) && (h[3] & 4) && (h[12] == 'B') && (h[13] == 'C');
+}
+
+/* Read up to BGZF_BATCH blocks and inflate them side by side into out, which
+   starts at position ustart of the uncompressed text.  Returns the number of
+   bytes added, 0 at the end of the file, or -1 with reader_errno set. */
+static long bgzf_fill (char *out, long room, off_t ustart)
+{
+   long in_start[BGZF_BATCH], in_length[BGZF_BATCH], out_start[BGZF_BATCH];
+   long in_used = 0, out_used = 0;
+   int i, n = 0, failed = FALSE;
+
+   while ((n < BGZF_BATCH) && (room - out_used >= BGZF_BLOCK)) {
+      unsigned char *h = bgzf_in + in_used;
+      long bsize, isize, got;
+
+      got = fread (h, 1, 18, reader_file);
+      if (got == 0) break;
+      if ((got != 18) || !is_bgzf (h)) {
+         reader_errno = EILSEQ;
+         return -1;
+      }
+      bsize = (h[16] | (h[17] << 8)) + 1;
+      if ((bsize < 26) || (fread (h + 18, 1, bsize - 18, reader_file) != (size_t) (bsize - 18))) {
+         reader_errno = ferror (reader_file) ? errno : EILSEQ;
+         return -1;
+      }
+      isize = h[bsize - 4] | (h[bsize - 3] << 8) | (h[bsize - 2] << 16) | ((long) h[bsize - 1] << 24);
+      if (isize > BGZF_BLOCK) {
+         reader_errno = EILSEQ;
+         return -1;
+      }
+      if (isize > 0) {
+         if (blocks == block_space) {
+            if (block_first > 0) {
+               memmove (block_ustart, block_ustart + block_first, (blocks - block_first) * sizeof (off_t));
+               memmove (block_offset, block_offset + block_first, (blocks - block_first) * sizeof (off_t));
+               memmove (block_length, block_length + block_first, (blocks - block_first) * sizeof (long));
+               blocks -= block_first;
+               block_first = 0;
+            } else {
+               block_space = block_space * 2 + 1024;
+               block_ustart = realloc (block_ustart, block_space * sizeof (off_t));
+               block_offset = realloc (block_offset, block_space * sizeof (off_t));
+               block_length = realloc (block_length, block_space * sizeof (long));
+               if ((block_ustart == NULL) || (block_offset == NULL) || (block_length == NULL)) {
+                  reader_errno = ENOMEM;
+                  return -1;
+               }
+            }
+         }
+         block_ustart[blocks] = ustart + out_used;
+         block_offset[blocks] = bgzf_offset;
+         block_length[blocks++] = isize;
+      }
+      in_start[n] = in_used;
+      in_length[n] = bsize;
+      out_start[n++] = out_used;
+      in_used += bsize;
+      out_used += isize;
+      bgzf_offset += bsize;
+   }
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(build_threads)
+   for (i = 0; i < n; i++) {
+      unsigned char *h = bgzf_in + in_start[i];
+      long bsize = in_length[i], isize = (i + 1 < n ? out_start[i + 1] : out_used) - out_start[i];
+      unsigned long crc = h[bsize - 8] | (h[bsize - 7] << 8) | (h[bsize - 6] << 16) | ((unsigned long) h[bsize - 5] << 24);
+      long data = 12 + (h[10] | (h[11] << 8));
+      z_stream z;
+
+      memset (&z, 0, sizeof (z));
+      if (inflateInit2 (&z, -15) != Z_OK) {
+         failed = TRUE;
+         continue;
+      }
+      z.next_in = h + data;
+      z.avail_in = bsize - 8 - data;
+      z.next_out = (unsigned char *) out + out_start[i];
+      z.avail_out = isize;
+      if ((inflate (&z, Z_FINISH) != Z_STREAM_END) || (z.total_out != (unsigned long) isize)
+          || (crc32 (0L, (unsigned char *) out + out_start[i], isize) != crc)) {
+         failed = TRUE;
+      }
+      inflateEnd (&z);
+   }
+   if (failed) {
+      reader_errno = EILSEQ;
+      return -1;
+   }
+   return out_used;
+}
+
+/* The BGZF virtual offset of position u of the text, which must be in
+   reader_buf; positions are asked for in increasing order. */
+static off_t virtual_offset (off_t u)
+{
+   while ((block_first < blocks) && (u >= block_ustart[block_first] + block_length[block_first])) block_first++;
+   if (block_first == blocks) return bgzf_offset << 16;
+   return (block_offset[block_first] << 16) | (u - block_ustart[block_first]);
+}
+
+/* The next line of input without its newline, or NULL at the end.  Only valid
+   until the next call, as the unread part of the buffer is moved down. */
+static char *reader_line (long *len)
+{
+   char *line, *nl;
+   ssize_t n;
+
+   for (;;) {
+      nl = memchr (reader_buf + reader_pos, '\n', reader_have - reader_pos);
+      if (nl || reader_eof) break;
+      if (reader_pos > 0) {
+         memmove (reader_buf, reader_buf + reader_pos, reader_have - reader_pos);
+         reader_have -= reader_pos;
+         reader_offset += reader_pos;
+         reader_pos = 0;
+      }
+      if (reader_have > READ_BLOCK - (bgzf ? BGZF_BLOCK : 1)) break;
+      if (bgzf) {
+         n = bgzf_fill (reader_buf + reader_have, READ_BLOCK - reader_have, reader_offset + reader_have);
+      } else if (reader_gz) {
+         n = gzread (reader_gz, reader_buf + reader_have, READ_BLOCK - reader_have);
+         if (n < 0) reader_errno = EILSEQ;
+      } else {
+         n = read (reader_fd, reader_buf + reader_have, READ_BLOCK - reader_have);
+         if ((n < 0) && (errno == EINTR)) continue;
+         if (n < 0) reader_errno = errno;
+      }
+      if (n <= 0) reader_eof = TRUE;
+      else reader_have += n;
+   }
+   line = reader_buf + reader_pos;
+   if (nl) {
+      *len = nl - line;
+      reader_pos += *len + 1;
+      return line;
+   }
+   if (reader_pos == reader_have) return NULL;
+   *len = reader_have - reader_pos;
+   reader_pos = reader_have;
+   return line;
+}
+
+static void *reader_main (void *arg)
+{
+   off_t *start = reader_start_offset;
+   int slot = 0, lineno = 1;
+
+   for (;;) {
+      READBATCH *b = &readbatch[slot];
+      long used = 0, len;
+      char *s;
+
+      pthread_mutex_lock (&readbatch_lock);
+      while (readbatch_full[slot]) pthread_cond_wait (&readbatch_cond, &readbatch_lock);
+      pthread_mutex_unlock (&readbatch_lock);
+
+      b->count = 0;
+      b->error_line = 0;
+      b->last = FALSE;
+      while (b->count < BATCH_READS) {
+         off_t record_start = reader_offset + reader_pos;
+
+         if (reader_line (&len) == NULL) {
+            start[b->count] = bgzf ? virtual_offset (record_start) : record_start;   /* the index ends with the file size */
+            b->last = TRUE;
+            break;
+         }
+         start[b->count] = bgzf ? virtual_offset (record_start) : record_start;
+         lineno++;
+         s = reader_line (&len);
+         if ((s == NULL) || (len >= MAX_LINE)) {
+            b->error_line = lineno;
+            break;
+         }
+         memcpy (b->text + used, s, len);
+         b->text[used + len] = '\0';
+         b->seq[b->count++] = b->text + used;
+         used += len + 1;
+
+         lineno++;
+         s = reader_line (&len);
+         if ((s == NULL) || (s[0] != '+')) {
+            b->error_line = lineno;
+            break;
+         }
+         lineno++;
+         (void) reader_line (&len);
+         lineno++;
+      }
+      if (read_index) fwrite (start, sizeof (off_t), b->count + (b->last ? 1 : 0), read_index);
+      b->read_errno = reader_errno;
+      if (b->error_line || b->read_errno) b->last = TRUE;
+
+      pthread_mutex_lock (&readbatch_lock);
+      readbatch_full[slot] = TRUE;
+      pthread_cond_broadcast (&readbatch_cond);
+      pthread_mutex_unlock (&readbatch_lock);
+      if (b->last) break;
+      slot ^= 1;
+   }
+   free (reader_start_offset);
+   reader_start_offset = NULL;
+   return NULL;
+}
+
+static void reader_start (FILE *f)
+{
+   int i;
+
+   reader_buf = malloc (READ_BLOCK);
+   reader_start_offset = malloc ((BATCH_READS + 1) * sizeof (off_t));
+   for (i = 0; i < 2; i++) readbatch[i].text = malloc ((long) BATCH_READS * MAX_LINE);
+   if ((reader_buf == NULL) || (reader_start_offset == NULL)
+       || (readbatch[0].text == NULL) || (readbatch[1].text == NULL)) {
+      fprintf (stderr, "maketrie: cannot allocate input buffers\n");
+      shut_down_other_nodes ();
+      MPI_Finalize ();
+      exit (EXIT_FAILURE);
+   }
+   reader_file = f;
+   reader_fd = fileno (f);
+   reader_offset = 0;
+   (void) posix_fadvise (reader_fd, (off_t) 0, (off_t) 0, POSIX_FADV_SEQUENTIAL);
+   {
+      unsigned char h[18];
+
+      if ((pread (reader_fd, h, sizeof (h), (off_t) 0) == sizeof (h)) && (h[0] == 0x1f) && (h[1] == 0x8b)) {
+         if (is_bgzf (h)) {
+            bgzf = TRUE;
+            bgzf_in = malloc (BGZF_BATCH * BGZF_BLOCK);
+            fprintf (stderr, "Reading BGZF input, inflating up to %d blocks at once\n", BGZF_BATCH);
+         } else {
+            reader_gz = gzdopen (dup (reader_fd), "r");
+            if (reader_gz) gzbuffer (reader_gz, 1 << 20);
+            fprintf (stderr, "Reading gzipped input (use bgzip for parallel decompression)\n");
+         }
+         if ((bgzf && (bgzf_in == NULL)) || (!bgzf && (reader_gz == NULL))) {
+            fprintf (stderr, "maketrie: cannot set up decompression of the input\n");
+            shut_down_other_nodes ();
+            MPI_Finalize ();
+            exit (EXIT_FAILURE);
+         }
+      }
+   }
+   if (pthread_create (&reader_thread, NULL, reader_main, NULL) != 0) {
+      fprintf (stderr, "maketrie: cannot start the input thread\n");
+      shut_down_other_nodes ();
+      MPI_Finalize ();
+      exit (EXIT_FAILURE);
+   }
+}
+
+static READBATCH *reader_next (int slot)
+{
+   pthread_mutex_lock (&readbatch_lock);
+   while (!readbatch_full[slot]) pthread_cond_wait (&readbatch_cond, &readbatch_lock);
+   pthread_mutex_unlock (&readbatch_lock);
+   return &readbatch[slot];
+}
+
+static void reader_release (int slot)
+{
+   pthread_mutex_lock (&readbatch_lock);
+   readbatch_full[slot] = FALSE;
+   pthread_cond_broadcast (&readbatch_cond);
+   pthread_mutex_unlock (&readbatch_lock);
+}
+
+#define MAX_PREFIX_BASES 4
+#define MAX_BUCKETS 625
+
+static char *bucket_buf[MAX_BUCKETS];
+static long bucket_used[MAX_BUCKETS], bucket_size[MAX_BUCKETS];
+static long bucket_reads[MAX_BUCKETS], bucket_resume[MAX_BUCKETS];
+static INDEX bucket_start[MAX_BUCKETS], bucket_next[MAX_BUCKETS];
+static INDEX bucket_limit[MAX_BUCKETS], bucket_dest[MAX_BUCKETS];
+
+static int prefix_bucket (char *s)
+{
+   int i, bucket = 0;
+
+   for (i = 0; i < prefix_bases; i++) bucket = bucket * 5 + letter_code (s[i]);
+   return bucket;
+}
+
+static INDEX prefix_parent (int b, int create, int *c)
+{
+   char *s = bucket_buf[b] + sizeof (long);
+   INDEX edge = ROOT_CELL;
+   int i;
+
+   for (i = 0; i < prefix_bases - 1; i++) {
+      *c = letter_code (s[i]);
+#if TAILS
+      if (create && (GET_EDGE (edge, *c) & TAIL_EDGE)) tail_push_down (edge, *c);
+#endif
+      if (create && (GET_EDGE (edge, *c) == 0LL)) {
+         SET_EDGE (edge, *c, get_next_free_edge ());
+      }
+      edge = GET_EDGE (edge, *c);
+   }
+   *c = letter_code (s[prefix_bases - 1]);
+   return edge;
+}
+
+static void prefix_stash (char *s, long read_number)
+{
+   int b, slen = strlen (s);
+   long need = sizeof (long) + slen + 1;
+
+   if (slen <= prefix_bases) {
+      add_read (s, ROOT_CELL, read_number, 0);
+      return;
+   }
+
+   b = prefix_bucket (s);
+   if (bucket_used[b] + need > bucket_size[b]) {
+      bucket_size[b] = (bucket_size[b] + need) * 2;
+      bucket_buf[b] = realloc (bucket_buf[b], bucket_size[b]);
+      if (bucket_buf[b] == NULL) {
+         fprintf (stderr, "maketrie: out of memory holding reads for bucket %d\n", b);
+         shut_down_other_nodes ();
+         MPI_Finalize ();
+         exit (EXIT_FAILURE);
+      }
+   }
+   memcpy (bucket_buf[b] + bucket_used[b], &read_number, sizeof (long));
+   memcpy (bucket_buf[b] + bucket_used[b] + sizeof (long), s, slen + 1);
+   bucket_used[b] += need;
+   bucket_reads[b]++;
+
+   for (; *s; s++) freq[(int) *s]++;
+   letters += slen;
+   length[slen]++;
+   seq++;
+}
+
+static int prefix_add_read (char *s, INDEX edge, long read_number,
+                            INDEX *next_free, INDEX limit)
+{
+   int c;
+
+   for (;;) {
+      c = letter_code (*s++);
+
+#if TAILS
+      if (GET_EDGE (edge, c) & TAIL_EDGE) {
+         char tail[TAIL_BASES + 1];
+         INDEX cell = GET_EDGE (edge, c) & NODE_LIMIT;
+         long tail_read;
+         int n;
+
+         if (*next_free > limit) return FALSE;
+         n = read_tail (cell, tail, &tail_read);
+         tail_unfold (cell, tail, n, tail_read, *next_free);
+         if (n > 1) (*next_free)++;
+         SET_EDGE (edge, c, cell);
+      }
+#endif
+
+      if (*s == '\0') {
+         if (GET_EDGE (edge, c) & ENDS_WORD) {
+#pragma omp critical (duplicates)
+            {
+               fprintf (duplicates, "%lld:0 %ld\n",
+                        GET_EDGE (edge, c) & EDGE_MASK, read_number);
+               dups++;
+            }
+         } else {
+            SET_EDGE (edge, c, ENDS_WORD | read_number);
+         }
+         return TRUE;
+      }
+
+      if (GET_EDGE (edge, c) == 0LL) {
+         if (*next_free > limit) return FALSE;
+#if TAILS
+         if (tail_length (s) > 0) {
+            make_tail (*next_free, s, tail_length (s), read_number);
+            SET_EDGE (edge, c, TAIL_EDGE | *next_free);
+            (*next_free)++;
+            return TRUE;
+         }
+#endif
+         SET_EDGE (edge, c, *next_free);
+         (*next_free)++;
+      }
+      edge = GET_EDGE (edge, c);
+   }
+}
+
+static int prefix_add_bucket (int b, long pos, INDEX *next_free, INDEX limit)
+{
+   while (pos < bucket_used[b]) {
+      long read_number;
+      char *s = bucket_buf[b] + pos + sizeof (long);
+
+      memcpy (&read_number, bucket_buf[b] + pos, sizeof (long));
+      if (!prefix_add_read (s + prefix_bases, bucket_start[b], read_number,
+                            next_free, limit)) {
+         bucket_resume[b] = pos;
+         return FALSE;
+      }
+      pos += sizeof (long) + strlen (s) + 1;
+   }
+   return TRUE;
+}
+
+#if EDGES_PER_CELL == 4
+static INDEX prefix_moved (INDEX cell, int buckets)
+{
+   int lo = 0, hi = buckets - 1, mid;
+
+   while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (bucket_start[mid] <= cell) lo = mid;
+      else hi = mid - 1;
+   }
+   while ((lo > 0) && (bucket_start[lo] > cell)) lo--;
+   if ((bucket_dest[lo] == 0) || (cell < bucket_start[lo]) || (cell >= bucket_next[lo])) return cell;
+   return cell - (bucket_start[lo] - bucket_dest[lo]);
+}
+
+static void prefix_move_nedges (int buckets)
+{
+   NEDGE *e;
+   EDGE child;
+   long i;
+
+   for (i = 0; i < nedge_buckets; i++) {
+      for (e = nedge_hash[i]; e; e = e->next) {
+         e->parent = prefix_moved (e->parent, buckets);
+         child = UNPACK_EDGE (e->child);
+         if (child && !(child & ENDS_WORD)) {
+            e->child = PACK_EDGE ((child & TAIL_EDGE) | prefix_moved (child & NODE_LIMIT, buckets));
+         }
+      }
+   }
+   if (nedge_buckets) nedge_rehash (nedge_buckets);
+}
+#endif
+
+static void prefix_build (void)
+{
+   int b, c, buckets = 1;
+   long total = 0L;
+   INDEX avail, start, dest, stale_end;
+   time_t curtime;
+
+   for (b = 0; b < prefix_bases; b++) buckets *= 5;
+   for (b = 0; b < buckets; b++) total += bucket_reads[b];
+   if (total == 0L) return;
+
+   for (b = 0; b < buckets; b++) {
+      if (bucket_reads[b]) (void) prefix_parent (b, TRUE, &c);
+   }
+
+   start = last_used_edge + 1;
+   avail = CHUNKSIZE - start;
+   for (b = 0; b < buckets; b++) {
+      INDEX share = (INDEX) ((double) avail * bucket_reads[b] / total);
+
+      bucket_start[b] = start;
+      bucket_next[b] = start + 1;
+      bucket_limit[b] = start + share - 1;
+      bucket_resume[b] = (bucket_reads[b] && (share == 0)) ? 0L : -1L;
+      start += share;
+   }
+
+   time (&curtime);
+   fprintf (stderr, "Building %d prefix subtries (%d bases) with %d threads at %s",
+            buckets, prefix_bases, build_threads, ctime (&curtime));
+
+#pragma omp parallel for schedule(dynamic, 1)
+   for (b = 0; b < buckets; b++) {
+      if (bucket_limit[b] >= bucket_start[b]) {
+         (void) prefix_add_bucket (b, 0L, &bucket_next[b], bucket_limit[b]);
+      }
+   }
+
+   dest = last_used_edge + 1;
+   stale_end = dest;
+   for (b = 0; b < buckets; b++) {
+      bucket_dest[b] = 0;
+      if (bucket_limit[b] < bucket_start[b]) continue;
+      if (bucket_next[b] > stale_end) stale_end = bucket_next[b];
+      bucket_dest[b] = dest;
+      dest += bucket_next[b] - bucket_start[b];
+   }
+
+#pragma omp parallel for schedule(dynamic, 1)
+   for (b = 0; b < buckets; b++) {
+      INDEX cell, delta = bucket_start[b] - bucket_dest[b];
+      int i;
+
+      if ((bucket_dest[b] == 0) || (delta == 0)) continue;
+      for (cell = bucket_start[b]; cell < bucket_next[b]; cell++) {
+         for (i = 0; i < EDGES_PER_CELL; i++) {
+            EDGE e = GET_EDGE (cell, i);
+
+            if (e && !(e & ENDS_WORD)) SET_EDGE (cell, i, e - delta);
+         }
+      }
+   }
+#if EDGES_PER_CELL == 4
+   prefix_move_nedges (buckets);
+#endif
+
+   for (b = 0; b < buckets; b++) {
+      INDEX parent;
+
+      if (bucket_dest[b] == 0) continue;
+      parent = prefix_parent (b, FALSE, &c);
+      if (bucket_dest[b] != bucket_start[b]) {
+         memmove (&trie_cell[bucket_dest[b]], &trie_cell[bucket_start[b]],
+                  (bucket_next[b] - bucket_start[b]) * sizeof (CELL));
+      }
+      bucket_start[b] = bucket_dest[b];
+      SET_EDGE (parent, c, bucket_start[b]);
+   }
+   last_used_edge = dest - 1;
+   if (stale_end > dest) {
+      memset (&trie_cell[dest], 0, (stale_end - dest) * sizeof (CELL));
+   }
+
+   for (b = 0; b < buckets; b++) {
+      INDEX next = last_used_edge + 1;
+
+      if (bucket_resume[b] < 0L) continue;
+      if (bucket_dest[b] == 0) {
+         bucket_start[b] = next++;
+         SET_EDGE (prefix_parent (b, FALSE, &c), c, bucket_start[b]);
+      }
+      if (!prefix_add_bucket (b, bucket_resume[b], &next, CHUNKSIZE - 1)) {
+         fprintf (stderr,
+                  "Ran out of free edges after %d reads (last_used_edge = %lld, MAX_SIZE = %lld)\n",
+                  seq, next, MAX_SIZE);
+         shut_down_other_nodes ();
+         MPI_Finalize ();
+         exit (EXIT_FAILURE);
+      }
+      last_used_edge = next - 1;
+   }
+
+   for (b = 0; b < buckets; b++) {
+      free (bucket_buf[b]);
+      bucket_buf[b] = NULL;
+   }
+   time (&curtime);
+   fprintf (stderr, "Prefix subtries joined at %s", ctime (&curtime));
+}
+
+
+/* -sorted holds a fixed size record for each unique read (see pack_sorted ()),
+   so the n'th read in sorted order goes at byte
+   SORTED_HEADER_BYTES + n * sorted_record_bytes.  So the trie is cut into pieces,
+   the reads in each piece are counted, and then every piece is written out at
+   once, each by whichever thread or rank holds it, without passing the reads
+   themselves between ranks.  Where a piece leads on to another rank, the
+   subtrees there are counted and written in one request per rank. */
+typedef struct {
+   char *text;
+   long records, space;
+   long long first;             /* number in -sorted of text's first record */
+} SORTEDBUF;
+
+typedef struct SORTEDPIECE {
+   EDGE edge;                   /* the subtree below here, or 0 for one read */
+   char *s;                     /* its path from the root */
+   int len;
+   long read_number;
+   long count;                  /* how many reads are in it */
+   long long first;             /* number in -sorted of its first read */
+   struct SORTEDPIECE *remote;  /* the subtrees inside it held by other ranks, */
+   long remotes, remote_space;  /*  in sorted order */
+} SORTEDPIECE;
+
+#define SORTED_BUFFER (1L << 20)
+
+static void flush_sorted (SORTEDBUF *b)
+{
+   size_t bytes = b->records * sorted_record_bytes, done = 0;
+   off_t offset = SORTED_HEADER_BYTES + (off_t) b->first * sorted_record_bytes;
+   long total;
+
+   while (done < bytes) {
+      ssize_t rc = pwrite (sorted_fd, b->text + done, bytes - done, offset + done);
+
+      if (rc < 0) {
+         if (errno == EINTR) continue;
+         fprintf (stderr, "maketrie[%d]: error writing sorted output \"%s\" - %s\n",
+                  mpirank, sorted_name, strerror (errno));
+         MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      done += rc;
+   }
+   total = __sync_add_and_fetch (&sorted_written, b->records);
+   if ((total / 1000000) != ((total - b->records) / 1000000)) {
+      time_t curtime;
+
+      time (&curtime);
+      fprintf (stderr, "maketrie[%d]: %ld unique and sorted reads written back at %s",
+               mpirank, total / 1000000 * 1000000, ctime (&curtime));
+   }
+   b->first += b->records;
+   b->records = 0;
+}
+
+/* A record is the read's original number, 8 bytes, then its bases 2 bits
+   each, four to a byte with the first in the low bits, then a bit for each
+   base that is set if it is really an N (whose 2 bits are 0). */
+static void pack_sorted (unsigned char *r, char *s, long long read_number)
+{
+   unsigned char *bases = r + 8, *n_mask = r + 8 + (read_length + 3) / 4;
+   int i;
+
+   memcpy (r, &read_number, 8);
+   memset (bases, 0, sorted_record_bytes - 8);
+   for (i = 0; i < read_length; i++) {
+      int c = letter_code (s[i]);
+
+      if (c == _N_) n_mask[i / 8] |= 1 << (i % 8);
+      else bases[i / 4] |= c << (2 * (i % 4));
+   }
+}
+
+static void put_sorted (SORTEDBUF *b, char *s, long long read_number)
+{
+   pack_sorted ((unsigned char *) b->text + b->records * sorted_record_bytes, s, read_number);
+   if (++b->records == b->space) flush_sorted (b);
+}
+
+static SORTEDPIECE *add_piece (SORTEDPIECE **piece, long *pieces, long *space,
+                               EDGE edge, char *s, int len)
+{
+   SORTEDPIECE *p;
+
+   if (*pieces == *space) {
+      *space = *space * 2 + 64;
+      *piece = realloc (*piece, *space * sizeof (SORTEDPIECE));
+      if (*piece == NULL) {
+         fprintf (stderr, "maketrie[%d]: cannot allocate sorted output pieces\n", mpirank);
+         MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+   }
+   p = &(*piece)[(*pieces)++];
+   memset (p, 0, sizeof (SORTEDPIECE));
+   p->edge = edge;
+   p->s = strdup (s);
+   p->len = len;
+   p->count = 1;
+   return p;
+}
+
+static void free_pieces (SORTEDPIECE *piece, long pieces)
+{
+   long i;
+
+   for (i = 0; i < pieces; i++) {
+      free_pieces (piece[i].remote, piece[i].remotes);
+      free (piece[i].s);
+   }
+   free (piece);
+}
+
+/* Only one of a rank's threads talks to another rank at a time. */
+static void remote_count_sorted (int target_rank, long n, EDGE *edge, long *count)
+{
+   MPI_Status status;
+
+#pragma omp critical (mpi)
+   {
+      MPI_Send (&n, 1, MPI_LONG, target_rank, TAG_COUNT_SORTED, MPI_COMM_WORLD);
+      MPI_Send (edge, n, MPI_LONG_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
+      MPI_Recv (count, n, MPI_LONG, target_rank, 0, MPI_COMM_WORLD, &status);
+   }
+}
+
+static void remote_write_sorted (int target_rank, long n, EDGE *edge, int *len,
+                                 long long *first, char *paths, long pathbytes)
+{
+   MPI_Status status;
+   long value;
+
+#pragma omp critical (mpi)
+   {
+      MPI_Send (&n, 1, MPI_LONG, target_rank, TAG_WRITE_SORTED, MPI_COMM_WORLD);
+      MPI_Send (&read_length, 1, MPI_INT, target_rank, TAG_DATA,
+                MPI_COMM_WORLD);
+      MPI_Send (edge, n, MPI_LONG_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
+      MPI_Send (len, n, MPI_INT, target_rank, TAG_DATA, MPI_COMM_WORLD);
+      MPI_Send (first, n, MPI_LONG_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
+      MPI_Send (&pathbytes, 1, MPI_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
+      send_bytes (target_rank, paths, pathbytes);
+      MPI_Recv (&value, 1, MPI_LONG, target_rank, 0, MPI_COMM_WORLD,
+                &status);
+   }
+}
+
+/* Counts the reads below edge on this rank, noting where the trie carries on
+   into another rank. */
+static long count_local (SORTEDPIECE *p, char *s, EDGE edge, int len)
+{
+   long count = 0L;
+   int i;
+
+   for (i = 0; i < 5; i++) {
+      EDGE e = GET_EDGE (LOCAL (edge), i);
+
+      s[len] = trt[i];
+      s[len + 1] = '\0';
+      if (e & ENDS_WORD) count++;
+#if TAILS
+      else if (e & TAIL_EDGE) count++;
+#endif
+      else if (e && (rank_of (e) != mpirank)) {
+         add_piece (&p->remote, &p->remotes, &p->remote_space, e, s, len + 1);
+      } else if (e) count += count_local (p, s, e, len + 1);
+   }
+   return count;
+}
+
+static long count_remotes (SORTEDPIECE *p)
+{
+   EDGE *edge;
+   long *count, i, n, total = 0L;
+   int r;
+
+   if (p->remotes == 0) return 0L;
+   edge = malloc (p->remotes * sizeof (EDGE));
+   count = malloc (p->remotes * sizeof (long));
+   if ((edge == NULL) || (count == NULL)) {
+      fprintf (stderr, "maketrie[%d]: cannot allocate sorted output pieces\n", mpirank);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   for (r = 0; r < mpisize; r++) {
+      for (i = n = 0; i < p->remotes; i++) {
+         if (rank_of (p->remote[i].edge) == r) edge[n++] = p->remote[i].edge;
+      }
+      if (n == 0) continue;
+      remote_count_sorted (r, n, edge, count);
+      for (i = n = 0; i < p->remotes; i++) {
+         if (rank_of (p->remote[i].edge) == r) {
+            p->remote[i].count = count[n++];
+            total += p->remote[i].count;
+         }
+      }
    }
-   return add_read (s, trie_cell[edge & CHUNKMASK].edge[c], read_number,
-                    len + 1);
-
+   free (edge);
+   free (count);
+   return total;
 }
-static INDEX remote_get_next_free_edge (target_rank)
-{
-   MPI_Status status;
-   long value = 0L;
-   INDEX free_edge;
 
-   assert (target_rank != mpirank);
-   MPI_Send (&value, 1, MPI_LONG, target_rank, TAG_GET_NEXT_FREE_EDGE,
-             MPI_COMM_WORLD);
-   assert (sizeof (INDEX) == sizeof (long long));
-   MPI_Recv (&free_edge, 1, MPI_LONG_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
+static void count_piece (SORTEDPIECE *p)
+{
+   char path[MAX_LINE];
 
-   return free_edge;
+   if (p->edge == 0LL) return;
+   if (rank_of (p->edge) != mpirank) {
+      add_piece (&p->remote, &p->remotes, &p->remote_space, p->edge, p->s, p->len);
+      p->count = count_remotes (p);
+   } else {
+      strcpy (path, p->s);
+      p->count = count_local (p, path, p->edge, p->len);
+      p->count += count_remotes (p);
+   }
 }
 
-static int remote_add_read (long target_rank, char *s, long edge,
-                            long read_number, int len)
+/* depth-first in base order, which puts the reads in sorted order */
+static void write_local (SORTEDPIECE *p, char *s, EDGE edge, int len, SORTEDBUF *b,
+                         long *next_remote)
 {
-   MPI_Status status;
-   long value = 0L;
-   long stringlength;
+   int i;
 
-   assert (target_rank != mpirank);
-   stringlength = strlen (s) + 1;
-   MPI_Send (&value, 1, MPI_LONG, target_rank, TAG_ADD_READ, MPI_COMM_WORLD);
-   MPI_Send (&stringlength, 1, MPI_LONG, target_rank, TAG_DATA,
-             MPI_COMM_WORLD);
-   send_bytes (target_rank, s, stringlength);
-   assert (sizeof (EDGE) == sizeof (long));
-   MPI_Send (&edge, 1, MPI_LONG, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   assert (sizeof (read_number) == sizeof (long));
-   MPI_Send (&read_number, 1, MPI_LONG, target_rank, TAG_DATA,
-             MPI_COMM_WORLD);
-   assert (sizeof (len) == sizeof (int));
-   MPI_Send (&len, 1, MPI_INT, target_rank, TAG_DATA, MPI_COMM_WORLD);
-   MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
+   for (i = 0; i < 5; i++) {
+      EDGE e = GET_EDGE (LOCAL (edge), i);
 
-   return (int) value;
+      s[len] = trt[i];
+      s[len + 1] = '\0';
+      if (e & ENDS_WORD) {
+         put_sorted (b, s, e & EDGE_MASK);
+#if TAILS
+      } else if (e & TAIL_EDGE) {
+         long read_number;
+
+         read_tail (LOCAL (e & NODE_LIMIT), s + len + 1, &read_number);
+         put_sorted (b, s, read_number);
+#endif
+      } else if (e && (rank_of (e) != mpirank)) {
+         SORTEDPIECE *r = &p->remote[(*next_remote)++];
+
+         flush_sorted (b);
+         r->first = b->first;
+         b->first += r->count;
+      } else if (e) {
+         write_local (p, s, e, len + 1, b, next_remote);
+      }
+   }
 }
 
-static void remote_output_read (long target_rank, char *s, EDGE readindex)
+static void write_remotes (SORTEDPIECE *p)
 {
-   MPI_Status status;
-   long value = 0L;
-   long stringlength;
-
-   assert (target_rank != mpirank);
-   stringlength = strlen (s) + 1;
-   MPI_Send (&value, 1, MPI_LONG, target_rank, TAG_OUTPUT_READ,
-             MPI_COMM_WORLD);
-   MPI_Send (&stringlength, 1, MPI_LONG, target_rank, TAG_DATA,
-             MPI_COMM_WORLD);
-   send_bytes (target_rank, s, stringlength);
-   MPI_Send (&readindex, 1, MPI_LONG_LONG, target_rank, TAG_DATA,
-             MPI_COMM_WORLD);
-   MPI_Recv (&value, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
+   EDGE *edge;
+   int *len, r;
+   long long *first;
+   char *paths;
+   long i, n, pathbytes;
+
+   if (p->remotes == 0) return;
+   edge = malloc (p->remotes * sizeof (EDGE));
+   len = malloc (p->remotes * sizeof (int));
+   first = malloc (p->remotes * sizeof (long long));
+   for (i = pathbytes = 0; i < p->remotes; i++) pathbytes += p->remote[i].len;
+   paths = malloc (pathbytes + 1);
+   if ((edge == NULL) || (len == NULL) || (first == NULL) || (paths == NULL)) {
+      fprintf (stderr, "maketrie[%d]: cannot allocate sorted output pieces\n", mpirank);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   for (r = 0; r < mpisize; r++) {
+      for (i = n = pathbytes = 0; i < p->remotes; i++) {
+         if (rank_of (p->remote[i].edge) != r) continue;
+         edge[n] = p->remote[i].edge;
+         len[n] = p->remote[i].len;
+         first[n] = p->remote[i].first;
+         memcpy (paths + pathbytes, p->remote[i].s, len[n]);
+         pathbytes += len[n];
+         n++;
+      }
+      if (n > 0) remote_write_sorted (r, n, edge, len, first, paths, pathbytes);
+   }
+   free (edge);
+   free (len);
+   free (first);
+   free (paths);
 }
 
-static void accept_get_next_free_edge (int caller)
+static void write_piece (SORTEDPIECE *p)
 {
-   INDEX new_edge;
+   SORTEDBUF b;
+   char path[MAX_LINE];
+   long next_remote = 0L;
 
-   new_edge = get_next_free_edge ();
-   MPI_Send (&new_edge, 1, MPI_LONG_LONG, caller, 0, MPI_COMM_WORLD);
+   if ((p->edge != 0LL) && (rank_of (p->edge) != mpirank)) {
+      p->remote[0].first = p->first;
+   } else {
+      b.space = (p->count < SORTED_BUFFER / sorted_record_bytes) ? p->count
+                : SORTED_BUFFER / sorted_record_bytes;
+      if (b.space < 1) b.space = 1;
+      b.text = malloc (b.space * sorted_record_bytes);
+      if (b.text == NULL) {
+         fprintf (stderr, "maketrie[%d]: cannot allocate sorted output buffer\n", mpirank);
+         MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      b.records = 0L;
+      b.first = p->first;
+      if (p->edge == 0LL) {
+         put_sorted (&b, p->s, p->read_number);
+      } else {
+         strcpy (path, p->s);
+         write_local (p, path, p->edge, p->len, &b, &next_remote);
+         flush_sorted (&b);
+      }
+      free (b.text);
+   }
+   write_remotes (p);
 }
 
-static void accept_add_read (int myrank, long value, MPI_Status status)
+/* Cut the trie below edge into pieces, in sorted order: single reads, and
+   subtrees either depth levels down or starting on another rank. */
+static void split_sorted (char *s, EDGE edge, int len, int depth,
+                          SORTEDPIECE **piece, long *pieces, long *space)
 {
-   char *s;
-   EDGE edge;
-   long read_number, stringlength;
-   int len;
-   int caller;
-
-   MPI_Recv (&stringlength, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   caller = status.MPI_SOURCE;
+   int i;
 
-   s = malloc (stringlength);
-   if (s == NULL) fprintf (stderr, "CRAP!  Failed to malloc... why\?\?\?\n");
-   MPI_Recv (s, stringlength, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   assert (sizeof (EDGE) == sizeof (long));
-   MPI_Recv (&edge, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
-   assert (sizeof (read_number) == sizeof (long));
-   MPI_Recv (&read_number, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   assert (sizeof (len) == sizeof (int));
-   MPI_Recv (&len, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
+   for (i = 0; i < 5; i++) {
+      EDGE e = GET_EDGE (LOCAL (edge), i);
+      SORTEDPIECE *p;
 
-   {
-      long long int target_rank = (long long int) edge >> CHUNKBITS;
-      assert (target_rank == mpirank);
+      s[len] = trt[i];
+      s[len + 1] = '\0';
+      if (e == 0LL) continue;
+      if (!(e & (ENDS_WORD | TAIL_EDGE)) && (depth > 1) && (rank_of (e) == mpirank)) {
+         split_sorted (s, e, len + 1, depth - 1, piece, pieces, space);
+         continue;
+      }
+      if (e & ENDS_WORD) {
+         p = add_piece (piece, pieces, space, 0LL, s, len + 1);
+         p->read_number = e & EDGE_MASK;
+#if TAILS
+      } else if (e & TAIL_EDGE) {
+         long read_number;
+
+         read_tail (LOCAL (e & NODE_LIMIT), s + len + 1, &read_number);
+         p = add_piece (piece, pieces, space, 0LL, s, len + 1);
+         p->read_number = read_number;
+#endif
+      } else {
+         add_piece (piece, pieces, space, e, s, len + 1);
+      }
    }
+}
 
-   value = add_read (s, edge, read_number, len);
-   free (s);
-   s = NULL;
+/* Count, then write, each of the pieces on as many threads as we have */
+static long write_pieces (SORTEDPIECE *piece, long pieces, long long first)
+{
+   long i, total = 0L;
 
-   MPI_Send (&value, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(build_threads)
+   for (i = 0; i < pieces; i++) count_piece (&piece[i]);
+   for (i = 0; i < pieces; i++) {
+      piece[i].first = first + total;
+      total += piece[i].count;
+   }
+#pragma omp parallel for schedule(dynamic, 1) num_threads(build_threads)
+   for (i = 0; i < pieces; i++) write_piece (&piece[i]);
+   return total;
 }
 
-static void walk_and_print_trie_internal (char *s, EDGE edge, int len);
-static void dump_trie (char *filename);
-static void accept_walk_and_print_trie_internal (int myrank, long value,
-                                                 MPI_Status status)
+static void accept_count_sorted (int myrank, long n, MPI_Status status)
 {
-   char s[MAX_LINE];
-   EDGE edge;
-   long stringlength;
-   int len;
+   SORTEDPIECE *piece = NULL;
+   EDGE *edge = malloc (n * sizeof (EDGE));
+   long *count = malloc (n * sizeof (long));
+   long i, pieces = 0L, space = 0L;
    int caller;
 
-   MPI_Recv (&stringlength, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
    caller = status.MPI_SOURCE;
-   MPI_Recv (s, stringlength, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   MPI_Recv (&edge, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             &status);
-   MPI_Recv (&len, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
+   if ((edge == NULL) || (count == NULL)) {
+      fprintf (stderr, "maketrie[%d]: cannot allocate sorted output pieces\n", mpirank);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   MPI_Recv (edge, n, MPI_LONG_LONG, caller, MPI_ANY_TAG, MPI_COMM_WORLD,
              &status);
-   walk_and_print_trie_internal (s, edge, len);
-   MPI_Send (&value, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+   /* the paths are not needed just to count */
+   for (i = 0; i < n; i++) add_piece (&piece, &pieces, &space, edge[i], "", 0);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(build_threads)
+   for (i = 0; i < n; i++) count_piece (&piece[i]);
+   for (i = 0; i < n; i++) count[i] = piece[i].count;
+   MPI_Send (count, n, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+   free_pieces (piece, pieces);
+   free (edge);
+   free (count);
 }
 
-static void accept_dump_trie (int myrank, long value, MPI_Status status)
+static void accept_write_sorted (int myrank, long n, MPI_Status status)
 {
-   char filename[MAX_LINE];
-   long stringlength;
+   SORTEDPIECE *piece = NULL;
+   EDGE *edge = malloc (n * sizeof (EDGE));
+   int *len = malloc (n * sizeof (int));
+   long long *first = malloc (n * sizeof (long long));
+   char *paths, s[MAX_LINE];
+   long i, pathbytes, pieces = 0L, space = 0L;
    int caller;
 
-   MPI_Recv (&stringlength, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
    caller = status.MPI_SOURCE;
-   MPI_Recv (filename, stringlength, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG,
+   if ((edge == NULL) || (len == NULL) || (first == NULL)) {
+      fprintf (stderr, "maketrie[%d]: cannot allocate sorted output pieces\n", mpirank);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   MPI_Recv (&read_length, 1, MPI_INT, caller, MPI_ANY_TAG,
              MPI_COMM_WORLD, &status);
-   dump_trie (filename);
-   MPI_Send (&value, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+   sorted_record_bytes = SORTED_RECORD_BYTES (read_length);
+   MPI_Recv (edge, n, MPI_LONG_LONG, caller, MPI_ANY_TAG, MPI_COMM_WORLD,
+             &status);
+   MPI_Recv (len, n, MPI_INT, caller, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+   MPI_Recv (first, n, MPI_LONG_LONG, caller, MPI_ANY_TAG, MPI_COMM_WORLD,
+             &status);
+   MPI_Recv (&pathbytes, 1, MPI_LONG, caller, MPI_ANY_TAG, MPI_COMM_WORLD,
+             &status);
+   paths = malloc (pathbytes + 1);
+   if (paths == NULL) {
+      fprintf (stderr, "maketrie[%d]: cannot allocate sorted output pieces\n", mpirank);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   MPI_Recv (paths, pathbytes, MPI_BYTE, caller, MPI_ANY_TAG, MPI_COMM_WORLD,
+             &status);
+   if (sorted_fd < 0) sorted_fd = open (sorted_name, O_WRONLY);
+   if (sorted_fd < 0) {
+      fprintf (stderr, "maketrie[%d]: cannot open sorted output \"%s\" - %s\n",
+               mpirank, sorted_name, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   for (i = pathbytes = 0; i < n; i++) {
+      memcpy (s, paths + pathbytes, len[i]);
+      s[len[i]] = '\0';
+      pathbytes += len[i];
+      add_piece (&piece, &pieces, &space, edge[i], s, len[i])->first = first[i];
+   }
+   /* each of these was counted for the caller, but what lies beyond them on
+      later ranks has to be counted again to place it */
+#pragma omp parallel for schedule(dynamic, 1) num_threads(build_threads)
+   for (i = 0; i < n; i++) {
+      count_piece (&piece[i]);
+      write_piece (&piece[i]);
+   }
+   MPI_Send (&n, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+   free_pieces (piece, pieces);
+   free (edge);
+   free (len);
+   free (first);
+   free (paths);
 }
 
-static void output_read (char *s, EDGE readindex);
-static void accept_output_read (int myrank, long value, MPI_Status status)
+/* Writes every read below edge, whose path is s[0..len-1], to -sorted from
+   line first on, and returns how many there were. */
+static long write_sorted_subtree (char *s, EDGE edge, int len, long long first)
 {
-   char *s;
-   EDGE readindex;
-   long stringlength;
-   int caller;
-
-   MPI_Recv (&stringlength, 1, MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   caller = status.MPI_SOURCE;
-
-   s = malloc (stringlength);
-   if (s == NULL) fprintf (stderr, "CRAP!  Failed to malloc... why\?\?\?\n");
-   MPI_Recv (s, stringlength, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-   MPI_Recv (&readindex, 1, MPI_LONG_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
-             MPI_COMM_WORLD, &status);
-
-   output_read (s, readindex);
-
-   free (s);
-   s = NULL;
+   SORTEDPIECE *piece = NULL;
+   long pieces = 0L, space = 0L, total;
+   int depth = 1, fanout = 5;
+
+   if ((build_threads == 1) && (mpisize == 1)) {
+      /* counting first would gain nothing, and costs as much as the writing */
+      SORTEDPIECE whole;
+      SORTEDBUF b;
+      long next_remote = 0L;
+
+      memset (&whole, 0, sizeof (SORTEDPIECE));
+      b.space = SORTED_BUFFER / sorted_record_bytes;
+      b.text = malloc (b.space * sorted_record_bytes);
+      if (b.text == NULL) {
+         fprintf (stderr, "maketrie[%d]: cannot allocate sorted output buffer\n", mpirank);
+         MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      b.records = 0L;
+      b.first = first;
+      write_local (&whole, s, edge, len, &b, &next_remote);
+      flush_sorted (&b);
+      free (b.text);
+      return b.first - first;
+   }
 
-   MPI_Send (&value, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
+   while (fanout < 16 * build_threads) {
+      fanout *= 5;
+      depth++;
+   }
+   split_sorted (s, edge, len, depth, &piece, &pieces, &space);
+   total = write_pieces (piece, pieces, first);
+   free_pieces (piece, pieces);
+   return total;
 }
 
-static void output_read (char *s, EDGE readindex)
+static void write_trie_header (void)
 {
-   time_t curtime;
-
-   if (mpirank == mpisize - 1) {
-      static int printed = 0;
-
-      fprintf (sorted_and_unique_reads, "%s %12lld\n", s, readindex);
-      if (ferror (sorted_and_unique_reads)) {
-         fprintf (stderr, "\n\n************* output_read() failed, %s\n",
-                  strerror (errno));
-         shut_down_other_nodes ();
-         MPI_Finalize ();
-         exit (EXIT_FAILURE);
-      }
-      printed++;
-      if ((printed % 1000000) == 0) {
-         time (&curtime);
-         fprintf (stderr, "%d unique and sorted reads written back at %s",
-                  printed, ctime (&curtime));
-      }
-   } else {
-      remote_output_read (mpisize - 1, s, readindex);
-   }
+   unsigned char *header = (unsigned char *) &trie_cell[0];
+
+   memset (header, 0, sizeof (CELL));
+   if ((EDGE_BITS == 64) && (EDGES_PER_CELL == 5) && !TAILS) return;
+   memcpy (header, TRIE_MAGIC, 4);
+   header[4] = EDGE_BITS / 8;
+   header[5] = EDGES_PER_CELL;
+   header[6] = TAILS;
 }
 
-static INDEX get_next_free_edge (void)
+/* Rank 0 creates (or empties) the file before anyone else opens it. */
+static int open_for_dump (char *filename)
 {
-   if (((last_used_edge + (INDEX) 1) >> CHUNKBITS) != mpirank) {
-      INDEX edge;
-      static int next_guy = 1;
-      static int init = FALSE;
+   int fd = -1;
 
-      if (!init) {
-         next_guy = mpirank + 1;
-         init = TRUE;
-         if (mpirank == mpisize) {
-            fprintf (stderr,
-                     "ERROR: not enough RAM for this input file (%d * %lld cells used)."
-                     "  Try resubmtting with some more processors.\n",
-                     mpisize, CHUNKSIZE);
-         }
-      }
-      edge = remote_get_next_free_edge (next_guy);
-      next_guy = (edge >> CHUNKBITS);
-      return edge;
-   } else
-      return ++last_used_edge;
+   if (mpirank == 0) fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   MPI_Barrier (MPI_COMM_WORLD);
+   if (mpirank != 0) fd = open (filename, O_WRONLY);
+   if (fd < 0) {
+      fprintf (stderr, "maketrie[%d]: Cannot save trie to %s - %s\n", mpirank,
+               filename, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   return fd;
 }
 
-static int add_read (char *s, EDGE edge, long read_number, int len)
+#define DUMP_PIECE (1L << 30)
+
+static void write_at (int fd, void *buffer, size_t bytes, off_t offset,
+                      char *filename, int progress)
 {
-   int len2;
-   long long int target_rank = (long long) edge >> CHUNKBITS;
+   char *p = buffer;
+   size_t done = 0;
 
-   if (len == 0) {
-      assert (edge == ROOT_CELL);
-      if (read_number > EDGE_MASK) {
-         fprintf (stderr, "maketrie: too many READs! (%ld)  Limit is %lld\n",
-                  read_number, EDGE_MASK);
-         assert (read_number <= EDGE_MASK);
+   while (done < bytes) {
+      size_t piece = (bytes - done < DUMP_PIECE) ? bytes - done : DUMP_PIECE;
+      ssize_t rc = pwrite (fd, p + done, piece, offset + done);
+
+      if (rc < 0) {
+         if (errno == EINTR) continue;
+         fprintf (stderr, "maketrie[%d]: Error saving trie to %s - %s\n",
+                  mpirank, filename, strerror (errno));
+         MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      done += rc;
+      if (progress && (done < bytes)) {
+         fprintf (stderr, "maketrie[%d]: %lldM of %lldM written\n", mpirank,
+                  (long long) done >> 20, (long long) bytes >> 20);
       }
-      seq++;
    }
+}
 
-   if (target_rank == mpirank) {
-      len2 = local_add_read (s, edge, read_number, len);
-      if (len == 0) length[len2]++;
-      return len2;
-   } else {
-      return remote_add_read ((long) target_rank, s, edge, read_number, len);
-   }
+#if EDGES_PER_CELL == 4
+static int compare_nedges (const void *a, const void *b)
+{
+   unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
 
+   return (x < y) ? -1 : (x > y);
 }
 
-static void walk_and_print_trie_internal (char *s, EDGE edge, int len)
+static void dump_nedges (char *filename)
 {
-   int i;
-   int target_rank = edge >> CHUNKBITS;
-
-   if (target_rank != mpirank) {
-      remote_walk_and_print_trie_internal (target_rank, s, edge, len);
-      return;
+   char fname[MAX_LINE];
+   unsigned long long *pairs;
+   NEDGE *e;
+   int fd;
+   long i, n = 0L, before = 0L;
+   size_t len = strlen (filename);
+
+   if ((len > 6) && (strcmp (filename + len - 6, "-edges") == 0)) len -= 6;
+   sprintf (fname, "%.*s-nedges", (int) len, filename);
+   pairs = malloc ((nedge_count + 1) * 2 * sizeof (unsigned long long));
+   if (pairs == NULL) {
+      fprintf (stderr, "maketrie[%d]: Cannot save N edges to %s - %s\n", mpirank,
+               fname, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
    }
-
-   s[len + 1] = '\0';
-   for (i = 0; i < 5; i++) {
-      s[len] = trt[i];
-      if (trie_cell[edge & CHUNKMASK].edge[i] & ENDS_WORD) {
-         output_read (s, trie_cell[edge & CHUNKMASK].edge[i] & EDGE_MASK);
-      } else if (trie_cell[edge & CHUNKMASK].edge[i]) {
-         walk_and_print_trie_internal (s, trie_cell[edge & CHUNKMASK].edge[i],
-                                       len + 1);
+   for (i = 0; i < nedge_buckets; i++) {
+      for (e = nedge_hash[i]; e; e = e->next) {
+         EDGE child = UNPACK_EDGE (e->child);
+
+         if (child == 0LL) continue;
+         pairs[n * 2] = e->parent + CHUNK_START;
+         pairs[n * 2 + 1] = child;
+         n++;
       }
    }
-
+   qsort (pairs, n, 2 * sizeof (unsigned long long), compare_nedges);
+
+   /* each rank's parents are above the previous rank's, so writing the ranks'
+      pairs one after another keeps the whole file sorted */
+   MPI_Exscan (&n, &before, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+   if (mpirank == 0) before = 0L;
+   fd = open_for_dump (fname);
+   write_at (fd, pairs, n * 2 * sizeof (unsigned long long),
+             (off_t) before * 2 * sizeof (unsigned long long), fname, FALSE);
+   if ((fsync (fd) != 0) || (close (fd) != 0)) {
+      fprintf (stderr, "maketrie[%d]: Error saving N edges to %s - %s\n",
+               mpirank, fname, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   free (pairs);
 }
+#endif
 
+/* Called on every rank at once (rank 0 asks the others to join in), and each
+   writes its own cells straight to their place in the file, so the dump takes
+   as long as the largest chunk rather than all of them end to end.  With -map
+   the cells are already in the file and only need flushing.  Rank 0 then cuts
+   the file off after the last cell in use. */
 static void dump_trie (char *filename)
 {
    time_t curtime;
-   int rc;
+   INDEX end = 0, trie_end;
+   int fd, r;
 
-   fprintf (stderr, "maketrie[%d]: ", mpirank);
-   if (mpirank == 0) {
-      trie_file = fopen (filename, "w");
-      fprintf (stderr, "Writing");
+   if (mpirank == 0) for (r = 1; r < mpisize; r++) remote_dump_trie (r, filename);
+
+   time (&curtime);
+   fprintf (stderr, "maketrie[%d]: %s dumped trie %s at %s", mpirank,
+            map_trie ? "Flushing" : "Writing", filename, ctime (&curtime));
+#if EDGES_PER_CELL == 4
+   dump_nedges (filename);
+#endif
+   if (last_used_edge >= CHUNK_START) end = last_used_edge + 1;
+   if (map_trie) {
+      fd = trie_fd;
+      if ((msync (map_base, map_length, MS_SYNC) != 0)
+          || (munmap (map_base, map_length) != 0)) {
+         fprintf (stderr, "maketrie[%d]: Error saving trie to %s - %s\n",
+                  mpirank, filename, strerror (errno));
+         MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+      }
+      map_base = NULL;
+      trie_fd = -1;
+      trie_cell = NULL;
    } else {
-      trie_file = fopen (filename, "a");
-      fprintf (stderr, "Appending");
+      fd = open_for_dump (filename);
+      if (end > 0) {
+         write_at (fd, trie_cell, (end - CHUNK_START) * sizeof (CELL),
+                   (off_t) CHUNK_START * sizeof (CELL), filename, TRUE);
+      }
    }
-   time (&curtime);
-   fprintf (stderr, " to dumped trie %s at %s\n", filename, ctime (&curtime));
-   if (trie_file == NULL) {
-      fprintf (stderr, "maketrie[%d]: Cannot save trie to %s - %s\n", mpirank,
-               filename, strerror (errno));
-      shut_down_other_nodes ();
-      MPI_Finalize ();
-      exit (EXIT_FAILURE);
+   if (fsync (fd) != 0) {
+      fprintf (stderr, "maketrie[%d]: Error saving trie to %s - %s\n",
+               mpirank, filename, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
    }
-   if (last_used_edge == (mpirank * CHUNKSIZE - 1)) return;
-
-   fwrite (trie_cell, last_used_edge + 1 - (mpirank * CHUNKSIZE),
-           sizeof (CELL), trie_file);
-   if (ferror (trie_file)) {
+   MPI_Reduce (&end, &trie_end, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+   if ((mpirank == 0) && (ftruncate (fd, (off_t) trie_end * sizeof (CELL)) != 0)) {
       fprintf (stderr, "maketrie[%d]: Error saving trie to %s - %s\n",
                mpirank, filename, strerror (errno));
-      shut_down_other_nodes ();
-      MPI_Finalize ();
-      exit (EXIT_FAILURE);
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+   }
+   if (close (fd) != 0) {
+      fprintf (stderr, "maketrie[%d]: Error saving trie to %s - %s\n",
+               mpirank, filename, strerror (errno));
+      MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
    }
+   MPI_Barrier (MPI_COMM_WORLD);
    time (&curtime);
    fprintf (stderr, "Written at %s\n", ctime (&curtime));
-   if (trie_file) {
-      rc = fclose (trie_file);
-      trie_file = NULL;
-      if (rc == EOF) {
-         fprintf (stderr, "maketrie[%d]: Error saving trie to %s - %s\n",
-                  mpirank, filename, strerror (errno));
-         shut_down_other_nodes ();
-         MPI_Finalize ();
-         exit (EXIT_FAILURE);
-      }
-   }
-
-   if (last_used_edge == ((mpirank + 1) * CHUNKSIZE - 1)) {
-      fprintf (stderr, "Not done.  Asking next rank to continue...\n");
-
-      if (mpirank != mpisize - 1) remote_dump_trie (mpirank + 1, filename);
-   }
 }
 
 static void walk_and_print_trie (void)
 {
    char s[MAX_LINE];
    time_t curtime;
+   long count;
+   SORTEDHEADER header;
 
    time (&curtime);
    fprintf (stderr, "Printing sorted reads at %s", ctime (&curtime));
-   walk_and_print_trie_internal (s, ROOT_CELL, 0);
-   if (mpirank == mpisize - 1) {
-      if (sorted_and_unique_reads) {
-         int rc = fclose (sorted_and_unique_reads);
-         sorted_and_unique_reads = NULL;
-         if (rc == EOF) {
-            fprintf (stderr,
-                     "maketrie[%d]: Error closing sorted output - %s\n",
-                     mpirank, strerror (errno));
-         }
-      }
+   sorted_record_bytes = SORTED_RECORD_BYTES (read_length);
+   count = write_sorted_subtree (s, ROOT_CELL, 0, 0LL);
+   memset (&header, 0, sizeof (header));
+   memcpy (header.magic, SORTED_MAGIC, 4);
+   header.read_length = read_length;
+   header.record_bytes = sorted_record_bytes;
+   header.reads = count;
+   if ((pwrite (sorted_fd, &header, sizeof (header), 0) != sizeof (header))
+       || (fsync (sorted_fd) != 0) || (close (sorted_fd) != 0)) {
+      fprintf (stderr,
+               "maketrie[%d]: Error closing sorted output - %s\n",
+               mpirank, strerror (errno));
    }
+   sorted_fd = -1;
    time (&curtime);
-   fprintf (stderr, "Printing sorted reads complete at %s", ctime (&curtime));
+   fprintf (stderr, "Printing %ld sorted reads complete at %s", count, ctime (&curtime));
 }
 
 int main (int argc, char **argv)
 {
    time_t curtime;
    char fname[1024];
-   char line[MAX_LINE];
-   int i, c, rc, lineno = 1, number_of_lengths = 0;
+   int i, c, rc, slot, number_of_lengths = 0;
    long read_number = 0;
-   int namelen;
+   int namelen, provided;
    char processor_name[MPI_MAX_PROCESSOR_NAME];
 
    time (&curtime);
    fprintf (stderr, "Program started at %s", ctime (&curtime));
 
-   MPI_Init (&argc, &argv);
+   MPI_Init_thread (&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
    MPI_Comm_size (MPI_COMM_WORLD, &mpisize);
    MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
    fprintf (stderr, "I am rank %d of world size %d\n", mpirank, mpisize);
+   if (provided < MPI_THREAD_SERIALIZED) {
+      if (mpirank == 0) {
+         fprintf (stderr,
+                  "Warning: this MPI implementation provides insufficient"
+                  " threading support - building the trie on one thread.\n");
+      }
+      omp_set_num_threads (1);
+   }
+#if EDGE_BITS == 40
+   if ((omp_get_max_threads () > 1) && (mpirank == 0)) {
+      fprintf (stderr,
+               "Warning: 40-bit edges cannot be updated atomically"
+               " - building the trie on one thread.\n");
+   }
+   omp_set_num_threads (1);
+#endif
+   build_threads = omp_get_max_threads ();
    MPI_Get_processor_name (processor_name, &namelen);
    if (processor_name && strchr (processor_name, '.')) *strchr (processor_name, '.') = '\0';
 
+   while ((argc >= 2) && (argv[1][0] == '-')) {
+      if (strncmp (argv[1], "-prefix=", strlen ("-prefix=")) == 0) {
+         prefix_bases = atoi (argv[1] + strlen ("-prefix="));
+         if ((prefix_bases < 1) || (prefix_bases > MAX_PREFIX_BASES)) {
+            if (mpirank == 0) {
+               fprintf (stderr, "maketrie: -prefix must be from 1 to %d\n",
+                        MAX_PREFIX_BASES);
+            }
+            MPI_Finalize ();
+            exit (EXIT_FAILURE);
+         }
+      } else if (strcmp (argv[1], "-map") == 0) {
+         map_trie = TRUE;
+      } else {
+         if (mpirank == 0) fprintf (stderr, "maketrie: unknown option %s\n", argv[1]);
+         MPI_Finalize ();
+         exit (EXIT_FAILURE);
+      }
+      argv++;
+      argc--;
+   }
+   if ((prefix_bases > 0) && (mpisize > 1)) {
+      if (mpirank == 0) {
+         fprintf (stderr, "warning: -prefix is only supported on a single rank - ignored\n");
+      }
+      prefix_bases = 0;
+   }
+
    if ((mpirank == 0) && (argc > 2)) {
       fprintf (stderr, "warning: extra parameter %s ignored...\n", argv[2]);
    }
@@ -696,19 +2556,21 @@ int main (int argc, char **argv)
       }
       fprintf (stderr, "Output: %s\n", fname);
 
-      if (mpirank == mpisize - 1) {
-         sprintf (fname, "%s-sorted", argv[1]);
-         sorted_and_unique_reads = fopen (fname, "w");
-         if (sorted_and_unique_reads == NULL) {
+      sprintf (sorted_name, "%s-sorted", argv[1]);
+      if (mpirank == 0) {
+         sorted_fd = open (sorted_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         if (sorted_fd < 0) {
             fprintf (stderr,
                      "maketrie[%d]: cannot create sorted output \"%s\" - %s\n",
-                     mpirank, fname, strerror (errno));
+                     mpirank, sorted_name, strerror (errno));
             shut_down_other_nodes ();
             MPI_Finalize ();
             exit (EXIT_FAILURE);
          }
-         fprintf (stderr, "Sorted READ Output: %s\n", fname);
+         fprintf (stderr, "Sorted READ Output: %s\n", sorted_name);
+      }
 
+      if (mpirank == mpisize - 1) {
          sprintf (fname, "%s-rejects", argv[1]);
          rejects = fopen (fname, "w");
          if (rejects == NULL) {
@@ -736,12 +2598,12 @@ int main (int argc, char **argv)
       }
 
    } else {
-      if (mpirank == 0) fprintf (stderr, "syntax: maketrie input.fastq\n");
+      if (mpirank == 0) fprintf (stderr, "syntax: maketrie [-prefix=1..%d] [-map] input.fastq\n", MAX_PREFIX_BASES);
       MPI_Finalize ();
       exit (EXIT_FAILURE);
    }
 
-   CHUNKBITS = (((INDEX) sizeof (INDEX)) * 8ULL) - 1ULL;
+   CHUNKSIZE = 1LL << 30LL;     /* if MemTotal cannot be read, as much as calloc gives us */
    {
       FILE *meminfo, *cpuinfo;
       long long memsize;
@@ -763,6 +2625,7 @@ int main (int argc, char **argv)
       if (PROCESSORS_PER_NODE == 0ULL) PROCESSORS_PER_NODE = CORES_PER_NODE;
 
       TASKS_PER_NODE = PROCESSORS_PER_NODE / (long long) omp_get_max_threads ();
+      if (TASKS_PER_NODE < 1) TASKS_PER_NODE = 1;
       fprintf (stderr,
                "Node %s, Rank %d, and running %lld ranks on this node.   <-------------------------------\n",
                processor_name, mpirank, TASKS_PER_NODE);
@@ -781,55 +2644,46 @@ int main (int argc, char **argv)
                memsize /= TASKS_PER_NODE;
                memsize /= (long long) sizeof (CELL);
 
-               CHUNKBITS = 1ULL;
-               for (;;) {
-                  if ((1ULL << CHUNKBITS) >= memsize) break;
-                  CHUNKBITS++;
-               }
-               CHUNKBITS -= 1ULL;
+               /* all of it, less a sixteenth for the system and our buffers */
+               CHUNKSIZE = memsize - (memsize >> 4);
                fprintf (stderr,
-                        "rounding down memsize to %lldM cells per core"
-                        " (%lld bits), ie %lldM cells per node\n",
-                        (1ULL << CHUNKBITS) >> 24ULL, CHUNKBITS,
-                        ((1ULL << CHUNKBITS) * TASKS_PER_NODE) >> 24ULL);
+                        "using %lldM cells per core, ie %lldM cells per node\n",
+                        CHUNKSIZE >> 20LL, (CHUNKSIZE * TASKS_PER_NODE) >> 20LL);
                break;
-            } else {
-               CHUNKBITS = CHUNKBITS >> 1ULL;
             }
          }
    }
-   CHUNKSIZE = (1ULL << CHUNKBITS);
-   CHUNKMASK = (CHUNKSIZE - 1ULL);
 
-   while (CHUNKBITS >= 16ULL) {
+   while (CHUNKSIZE >= (1LL << 16LL)) {
       fprintf (stderr,
-               "Node %d: trying calloc of %lld cells of %d bytes each.\n",
-               mpirank, CHUNKSIZE, (int) sizeof (CELL));
-      trie_cell = calloc (CHUNKSIZE, sizeof (CELL));
+               "Node %d: trying %s of %lld cells of %d bytes each.\n",
+               mpirank, map_trie ? "mapping" : "calloc", CHUNKSIZE, (int) sizeof (CELL));
+      trie_cell = chunk_alloc ();
       if (trie_cell == NULL) {
-         CHUNKBITS -= 1ULL;
-         CHUNKSIZE = (1ULL << CHUNKBITS);
-         CHUNKMASK = (CHUNKSIZE - 1ULL);
+         CHUNKSIZE -= CHUNKSIZE >> 3;
       } else
          break;
    }
 
 #ifdef MULTINODE_DEBUG100
 
-   free (trie_cell);
-   CHUNKBITS = 8;
-   CHUNKSIZE = (1ULL << CHUNKBITS);
-   CHUNKMASK = (CHUNKSIZE - 1ULL);
-   trie_cell = calloc (CHUNKSIZE, sizeof (CELL));
+   chunk_free ();
+   CHUNKSIZE = 256;
+   trie_cell = chunk_alloc ();
 #endif
 
 #ifdef MULTINODE_DEBUG1K
 
-   free (trie_cell);
-   CHUNKBITS = 9;
-   CHUNKSIZE = (1ULL << CHUNKBITS);
-   CHUNKMASK = (CHUNKSIZE - 1ULL);
-   trie_cell = calloc (CHUNKSIZE, sizeof (CELL));
+   chunk_free ();
+   CHUNKSIZE = 512;
+   trie_cell = chunk_alloc ();
+#endif
+
+#ifdef MULTINODE_DEBUG_UNEVEN
+
+   chunk_free ();
+   CHUNKSIZE = 300 + 57 * mpirank;
+   trie_cell = chunk_alloc ();
 #endif
 
    if (trie_cell == NULL) {
@@ -849,15 +2703,26 @@ int main (int argc, char **argv)
             mpirank, (int) (CHUNKSIZE >> 24ULL)
     );
 
-   MAX_SIZE = CHUNKSIZE * mpisize;
-   fprintf (stderr, "setting MAX_SIZE to %lld (%lld * %d)\n", MAX_SIZE,
-            CHUNKSIZE, mpisize);
+   outbatch = calloc (mpisize, sizeof (OUTBATCH));
+   for (i = 0; i < mpisize; i++) {
+      outbatch[i].req[0] = outbatch[i].req[1] = MPI_REQUEST_NULL;
+      outbatch[i].count_req[0] = outbatch[i].count_req[1] = MPI_REQUEST_NULL;
+   }
+   set_chunk_table ();
+   if (map_trie) {
+      sprintf (fname, "%s-edges", argv[1]);
+      map_trie_file (fname);
+   }
+   MAX_SIZE = chunk_base[mpisize];
+   if (MAX_SIZE > NODE_LIMIT) MAX_SIZE = NODE_LIMIT + 1ULL;
+   fprintf (stderr, "setting MAX_SIZE to %lld (%lld on this rank, %s across %d ranks)\n", MAX_SIZE,
+            CHUNKSIZE, chunk_uniform ? "the same" : "varying", mpisize);
 
    for (i = 0; i < 256; i++) freq[i] = 0;
    for (i = 0; i < MAX_LINE; i++) length[i] = 0;
-   for (i = 0; i < 5; i++) empty.edge[i] = 0LL;
+   memset (&empty, 0, sizeof (CELL));
 
-   for (i = 0; i < 5; i++) trie_cell[ROOT_CELL].edge[i] = 0LL;
+   memset (&trie_cell[ROOT_CELL], 0, sizeof (CELL));
 #ifdef TWONODE_DEBUG
    last_used_edge = CHUNKSIZE - 100ULL;
 #endif
@@ -869,53 +2734,68 @@ int main (int argc, char **argv)
 
       fprintf (stderr,
                "\nCombined system is using %lldM trie edges distributed across %d ranks\n\n",
-               (long long) mpisize * (CHUNKSIZE >> 24ULL), mpisize);
-
-      for (;;) {
-         int len;
-         off_t read_start;
-         char *s;
-
-         read_start = ftello (read_file);
-         if (read_index) fwrite (&read_start, sizeof (off_t), 1, read_index);
+               (long long) (chunk_base[mpisize] >> 20ULL), mpisize);
 
-         s = fgets (line, MAX_LINE, read_file);
-         if (s == NULL) break;
+      if (build_threads > 1) {
+         fprintf (stderr, "Inserting reads with %d threads\n", build_threads);
+      }
 
-         lineno++;
-         fgets (line, MAX_LINE, read_file);
-         s = strchr (line, '\n');
-         if (s) *s = '\0';
-         len = add_read (line, ROOT_CELL, read_number++, 0);
+      reader_start (read_file);
+      for (slot = 0;; slot ^= 1) {
+         READBATCH *b = reader_next (slot);
+         int last;
 
-         lineno++;
-         fgets (line, MAX_LINE, read_file);
-         if (line[0] != '+') {
-            fprintf (stderr, "Input data format error in READ file line %d\n",
-                     lineno);
+         if (read_number + b->count >= 0x7FFFFFFF) {
+            fprintf (stderr,
+                     "maketrie: an assumption was wrong.  We have an input file "
+                     "with more than %d READs.  Code fix needed.\n",
+                     0x7FFFFFFF);
             shut_down_other_nodes ();
             MPI_Finalize ();
             exit (EXIT_FAILURE);
          }
-
-         lineno++;
-         fgets (line, MAX_LINE, read_file);
-         lineno++;
-         if ((read_number % 1000000) == 0) {
-            time_t curtime;
-            time (&curtime);
-            fprintf (stderr, "%ld READs loaded at %s", read_number,
-                     ctime (&curtime));
+         if (prefix_bases > 0) {
+            for (i = 0; i < b->count; i++) prefix_stash (b->seq[i], read_number + i);
+         } else {
+            add_batch (b->seq, read_number, b->count);
          }
-         if (read_number == 0x7FFFFFFF) {
-            fprintf (stderr,
-                     "maketrie: an assumption was wrong.  We have an input file "
-                     "with more than %d READs.  Code fix needed.\n",
-                     0x7FFFFFFF);
+         for (i = 0; i < b->count; i++) {
+            if (((read_number + i + 1) % 1000000) == 0) {
+               time_t curtime;
+               time (&curtime);
+               fprintf (stderr, "%ld READs loaded at %s", read_number + i + 1,
+                        ctime (&curtime));
+            }
+         }
+         read_number += b->count;
+         if (b->read_errno) {
+            fprintf (stderr, "maketrie: error reading %s - %s\n", argv[1],
+                     (b->read_errno == EILSEQ) ? "corrupt compressed data" : strerror (b->read_errno));
+            shut_down_other_nodes ();
+            MPI_Finalize ();
+            exit (EXIT_FAILURE);
+         }
+         if (b->error_line) {
+            fprintf (stderr, "Input data format error in READ file line %d\n",
+                     b->error_line);
             shut_down_other_nodes ();
             MPI_Finalize ();
             exit (EXIT_FAILURE);
          }
+         last = b->last;
+         reader_release (slot);
+         if (last) break;
+      }
+      pthread_join (reader_thread, NULL);
+      if (reader_gz) gzclose (reader_gz);
+      if (prefix_bases > 0) prefix_build ();
+      if (mpisize > 1) {
+         MPI_Status status;
+         long value;
+
+         finish_adds ();
+         MPI_Recv (&value, 1, MPI_LONG, mpisize - 1, TAG_ACK, MPI_COMM_WORLD,
+                   &status);
       }
       if (duplicates) {
          rc = fclose (duplicates);
@@ -996,6 +2876,7 @@ int main (int argc, char **argv)
       fflush (stderr);
 
       walk_and_print_trie ();
+      write_trie_header ();
       sprintf (fname, "%s-edges", argv[1]);
       dump_trie (fname);
 
@@ -1015,17 +2896,18 @@ int main (int argc, char **argv)
       time (&curtime);
       fprintf (stderr, "Program complete at %s", ctime (&curtime));
       shut_down_other_nodes ();
-      free (trie_cell);
-      trie_cell = NULL;
+      chunk_free ();
 
    } else {
       INDEX index;
       CELL read_value;
       long longvalue;
+      int flushes_seen = 0;
       MPI_Status status;
 
-      for (i = 0; i < 5; i++) empty.edge[i] = 0LL;
-      last_used_edge = mpirank * CHUNKSIZE - 1;
+      memset (&empty, 0, sizeof (CELL));
+      last_used_edge = CHUNK_START - 1;
+      lease_rank = mpirank + 1;
 
       for (;;) {
          int caller;
@@ -1035,36 +2917,35 @@ int main (int argc, char **argv)
          caller = status.MPI_SOURCE;
 
          if (status.MPI_TAG == TAG_READ_READ) {
-            MPI_Recv (&index, 1, MPI_LONG_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
+            MPI_Recv (&index, 1, MPI_LONG_LONG, caller, MPI_ANY_TAG,
                       MPI_COMM_WORLD, &status);
             getread (index, &read_value);
-            MPI_Send (&read_value.edge,
-                      sizeof (read_value.edge) / sizeof (read_value.edge[0]),
-                      MPI_LONG, caller, 0, MPI_COMM_WORLD);
+            MPI_Send (&read_value, sizeof (CELL), MPI_BYTE, caller, 0,
+                      MPI_COMM_WORLD);
 
          } else if (status.MPI_TAG == TAG_WRITE_READ) {
-            MPI_Recv (&index, 1, MPI_LONG_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG,
+            MPI_Recv (&index, 1, MPI_LONG_LONG, caller, MPI_ANY_TAG,
                       MPI_COMM_WORLD, &status);
-            assert (sizeof (read_value.edge[0]) == sizeof (long));
-            MPI_Recv (&read_value.edge,
-                      sizeof (read_value.edge) / sizeof (read_value.edge[0]),
-                      MPI_LONG, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-                      &status);
+            MPI_Recv (&read_value, sizeof (CELL), MPI_BYTE, caller,
+                      MPI_ANY_TAG, MPI_COMM_WORLD, &status);
             setread (index, read_value);
             MPI_Send (&longvalue, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
 
-         } else if (status.MPI_TAG == TAG_ADD_READ) {
-            accept_add_read (mpirank, longvalue, status);
+         } else if (status.MPI_TAG == TAG_ADD_READ_BATCH) {
+            accept_add_read_batch (mpirank, longvalue, status);
 
-         } else if (status.MPI_TAG == TAG_GET_NEXT_FREE_EDGE) {
-            accept_get_next_free_edge (caller);
+         } else if (status.MPI_TAG == TAG_FLUSH) {
+            if (++flushes_seen == mpirank) finish_adds ();
+
+         } else if (status.MPI_TAG == TAG_LEASE_EDGES) {
+            accept_lease_edges (caller);
             MPI_Send (&longvalue, 1, MPI_LONG, caller, 0, MPI_COMM_WORLD);
 
-         } else if (status.MPI_TAG == TAG_OUTPUT_READ) {
-            accept_output_read (mpirank, longvalue, status);
+         } else if (status.MPI_TAG == TAG_COUNT_SORTED) {
+            accept_count_sorted (mpirank, longvalue, status);
 
-         } else if (status.MPI_TAG == TAG_WALK_AND_PRINT_TRIE_INTERNAL) {
-            accept_walk_and_print_trie_internal (mpirank, longvalue, status);
+         } else if (status.MPI_TAG == TAG_WRITE_SORTED) {
+            accept_write_sorted (mpirank, longvalue, status);
 
          } else if (status.MPI_TAG == TAG_DUMP_TRIE) {
             accept_dump_trie (mpirank, longvalue, status);
@@ -1082,8 +2963,8 @@ int main (int argc, char **argv)
       fprintf (stderr,
                "Node %d exiting cleanly.  local base = %lld,"
                "  last_used_edge = %lld,  local maximum = %lld\n",
-               mpirank, mpirank * CHUNKSIZE, last_used_edge,
-               (mpirank + 1) * CHUNKSIZE);
+               mpirank, CHUNK_START, last_used_edge,
+               CHUNK_END + 1);
       if (duplicates) {
          rc = fclose (duplicates);
          duplicates = NULL;
@@ -1093,8 +2974,8 @@ int main (int argc, char **argv)
          }
       }
 
-      if (trie_cell != NULL) free (trie_cell);
-      trie_cell = NULL;
+      if (sorted_fd >= 0) close (sorted_fd);
+      chunk_free ();
 
    }
 
@@ -15,6 +15,7 @@ typedef unsigned long long EDGE;
 typedef unsigned long long INDEX;
 #define ENDS_WORD (1ULL<<63ULL)
 #define EDGE_MASK (ENDS_WORD-1ULL)
+#define TAIL_EDGE (1ULL<<62ULL) // with 'tails' set, points at the packed rest of a single read
 
 #define MAX_LINE 1024
 #define MIN_OVERLAP 13
@@ -34,7 +35,18 @@ typedef struct node {
   // ACGT maps to 0 1 2 3, anything else such as 'N' is 4
   EDGE edge[5];
 } CELL;
-CELL *trie_cell;
+static unsigned char *trie_bytes; // the mmap'd -edges file, or NULL
+
+// maketrie can also be built with compact 32- or 40-bit edges (EDGE_BITS), in which
+// case the unused cell 0 starts with TRIE_MAGIC, the edge width in bytes and the
+// number of edges per cell.  Files from the original layout have cell 0 all zero.
+// With 4 edges per cell (EDGES_PER_CELL=4) the N edges live in a separate
+// <input>-nedges file of sorted (parent, child) pairs.
+#define TRIE_MAGIC "TRIE"
+static int edge_bytes = sizeof(EDGE), edge_ways = 5, cell_bytes = sizeof(CELL);
+static int tails; // set when maketrie was built with TAILS
+static unsigned long long *nedges; // (parent, child) pairs, sorted by parent
+static long nedge_count;
 
 static INDEX last_used_edge; // inclusive
 static INDEX contig_number = 1;
@@ -56,6 +68,7 @@ char *trt = "ACGTN"; // translate table back from the above
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <zlib.h>
 #include <assert.h>
 
 #define _XOPEN_SOURCE 500
@@ -70,23 +83,191 @@ ssize_t pread(int fd, void *buf, size_t count, off_t offset);
 static int freq[256];
 static int printed = FALSE;
 static long long *read_sequence_no_to_file_offset, contig_size;
-static FILE *read_file, *gene_file, *afg_contig_file, *afg_tle_file, *afg_reads_file;
+static gzFile read_file; // plain or gzipped; zlib reads either
+static int read_fd = -1, bgzf; // with BGZF input, -index holds virtual offsets: (block offset << 16) | offset in block
+static char *read_text; // plain gzip input, inflated whole as it cannot be entered part way through
+static long long read_text_length, read_text_pos;
+static FILE *gene_file, *afg_contig_file, *afg_tle_file, *afg_reads_file;
 static int trie_fd = -1, index_fd = -1;
-static off_t file_length;
+static off_t file_length, trie_length;
 static char gene_file_name[MAX_LINE];
 static char trie_file_name[MAX_LINE];
 static char index_file_name[MAX_LINE];
+static char nedge_file_name[MAX_LINE];
+
+static void read_trie_header(int fd)
+{
+  unsigned char header[8];
+
+  if ((pread(fd, header, sizeof(header), (off_t)0LL) == sizeof(header)) && (memcmp(header, TRIE_MAGIC, 4) == 0)) {
+    edge_bytes = header[4];
+    edge_ways = header[5];
+    tails = header[6];
+    if (((edge_ways != 4) && (edge_ways != 5)) || ((edge_bytes != 4) && (edge_bytes != 5) && (edge_bytes != 8)) || (tails > 1)) {
+      fprintf(stderr, "nearmatch: unsupported trie format (%d-byte edges, %d per cell)\n", header[4], header[5]);
+      exit(EXIT_FAILURE);
+    }
+    cell_bytes = edge_bytes*edge_ways;
+  }
+}
+
+static void load_nedges(char *filename)
+{
+  FILE *f;
+  long bytes;
+
+  if (edge_ways == 5) return;
+  f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "%s: cannot access N edge file %s - %s\n", "nearmatch", filename, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fseek(f, 0L, SEEK_END); bytes = ftell(f); fseek(f, 0L, SEEK_SET);
+  nedge_count = bytes / (2*sizeof(unsigned long long));
+  nedges = malloc(nedge_count*2*sizeof(unsigned long long) + 1);
+  if ((nedges == NULL) || (fread(nedges, 2*sizeof(unsigned long long), nedge_count, f) != (size_t)nedge_count)) {
+    fprintf(stderr, "%s: cannot load N edge file %s\n", "nearmatch", filename);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+}
+
+static EDGE nedge_lookup(INDEX idx)
+{
+  long lo = 0, hi = nedge_count-1, mid;
+
+  while (lo <= hi) {
+    mid = (lo+hi)/2;
+    if (nedges[mid*2] == (unsigned long long)idx) return nedges[mid*2+1];
+    if (nedges[mid*2] < (unsigned long long)idx) lo = mid+1; else hi = mid-1;
+  }
+  return 0LL;
+}
+
+static void fetch_trie_cell(INDEX idx, CELL *cellp, int want_n)
+{
+  unsigned char raw[sizeof(CELL)], *p;
+  int i, b;
+
+  if (trie_bytes && ((off_t)(idx+1)*cell_bytes <= trie_length)) {
+    p = trie_bytes + idx*cell_bytes;
+  } else {
+    ssize_t rc = pread(trie_fd, raw, cell_bytes, (off_t)idx*cell_bytes);
+    if (rc != cell_bytes) {
+      fprintf(stderr, "nearmatch: failed to fetch %d bytes from offset 0x%llx on file %d, rc = %d\n",
+              cell_bytes, (long long)idx*cell_bytes, trie_fd, (int)rc); exit(1);
+    }
+    p = raw;
+  }
+  if (cell_bytes == sizeof(CELL)) {
+    memcpy(cellp, p, sizeof(CELL));
+    return;
+  }
+  for (i = 0; i < edge_ways; i++) { // packed little-endian, with the top bit as ENDS_WORD
+    EDGE e = 0LL;
+    for (b = edge_bytes-1; b >= 0; b--) e = (e << 8) | p[i*edge_bytes+b];
+    if (e >> (edge_bytes*8-1)) e = ENDS_WORD | (e & ((1ULL << (edge_bytes*8-1))-1ULL));
+    else if (tails && (e >> (edge_bytes*8-2))) e = TAIL_EDGE | (e & ((1ULL << (edge_bytes*8-2))-1ULL));
+    cellp->edge[i] = e;
+  }
+  if (edge_ways == 4) cellp->edge[_N_] = want_n ? nedge_lookup(idx) : 0LL;
+}
+
+// A tail cell holds the read number in its first edge and then, edge_bytes*8-1 bits
+// per remaining edge, a base count followed by the bases at 2 bits each.
+// Returns the read number, and the bases in s unless s is NULL.
+static EDGE read_tail(INDEX idx, char *s)
+{
+  CELL tmp;
+  int bits = edge_bytes*8-1, n = 0, i, b;
+
+  fetch_trie_cell(idx, &tmp, FALSE);
+  for (b = 0; b < 8; b++) n |= ((tmp.edge[1+b/bits] >> (b%bits)) & 1) << b;
+  for (i = 0; s && (i < n); i++) {
+    int code = 0;
+    for (b = 8+2*i; b < 10+2*i; b++) code |= ((tmp.edge[1+b/bits] >> (b%bits)) & 1) << (b&1);
+    s[i] = trt[code];
+  }
+  if (s) s[n] = '\0';
+  return tmp.edge[0]&EDGE_MASK;
+}
+
+static int is_bgzf(int fd)
+{
+  unsigned char h[16];
+
+  return (pread(fd, h, sizeof(h), (off_t)0) == sizeof(h)) && (h[0] == 0x1f) && (h[1] == 0x8b)
+         && (h[3] & 4) && (h[12] == 'B') && (h[13] == 'C');
+}
+
+static void load_read_text(void)
+{
+  long long space = 1LL<<24LL;
+  int n;
+
+  read_text = malloc(space);
+  for (;;) {
+    if (read_text_length == space) read_text = realloc(read_text, space *= 2LL);
+    if (read_text == NULL) {
+      fprintf(stderr, "nearmatch: not enough memory to inflate the fastq file - use bgzip instead of gzip\n");
+      exit(EXIT_FAILURE);
+    }
+    n = gzread(read_file, read_text + read_text_length,
+               (unsigned)((space - read_text_length > (1LL<<30LL)) ? (1LL<<30LL) : (space - read_text_length)));
+    if (n <= 0) break;
+    read_text_length += n;
+  }
+  if (n < 0) {
+    fprintf(stderr, "nearmatch: error inflating the fastq file\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void seek_read(long long textp)
+{
+  if (read_text) {
+    read_text_pos = textp;
+    return;
+  }
+  if (bgzf) { // each BGZF block is a complete gzip member, so start inflating at the one holding the read
+    gzclose(read_file);
+    (void)lseek(read_fd, (off_t)(textp >> 16), SEEK_SET);
+    read_file = gzdopen(dup(read_fd), "r");
+    if (read_file == NULL) {
+      fprintf(stderr, "cannot reopen fastq file - %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    textp &= 0xFFFFLL;
+  }
+  (void)gzseek(read_file, (z_off_t)textp, SEEK_SET);
+}
+
+static char *gets_read(char *line) // fgets() from wherever the reads are
+{
+  long long n;
+  char *nl;
+
+  if (read_text == NULL) return gzgets(read_file, line, MAX_LINE);
+  if (read_text_pos >= read_text_length) return NULL;
+  n = read_text_length - read_text_pos;
+  if (n > MAX_LINE-1) n = MAX_LINE-1;
+  nl = memchr(read_text + read_text_pos, '\n', n);
+  if (nl) n = nl - (read_text + read_text_pos) + 1;
+  memcpy(line, read_text + read_text_pos, n); line[n] = '\0';
+  read_text_pos += n;
+  return line;
+}
 
 static char *stringat(long long textp)
 {
   char line[MAX_LINE], qual[MAX_LINE];
   char *s;
-  (void)fseek(read_file, textp, SEEK_SET);
-  s = fgets(line, MAX_LINE, read_file);
-  fgets(line, MAX_LINE, read_file);
+  seek_read(textp);
+  s = gets_read(line);
+  gets_read(line);
   s = strchr(line, '\n'); if (s) *s = '\0'; // trim trailing newline
-  fgets(qual, MAX_LINE, read_file);
-  s = fgets(qual, MAX_LINE, read_file);
+  gets_read(qual);
+  s = gets_read(qual);
   s = strchr(qual, '\n'); if (s) *s = '\0'; // trim trailing newline
   strcat(line, ";");
   strcat(line, qual);
@@ -124,16 +305,12 @@ void print_remaining_trie(INDEX trie_index, int trie_fd, int index_fd, int offse
   CELL *this;
 
   //fprintf(stderr, "> print_remaining_trie(%lld)\n", trie_index);
-  if (trie_cell && (trie_index <= last_used_edge)) {
-    this = &trie_cell[trie_index];
-  } else {
-    ssize_t rc = pread(trie_fd, &tmp, sizeof(CELL), trie_index*sizeof(CELL));
-    if (rc != sizeof(CELL)) {
-      fprintf(stderr, "overlap: failed to fetch %ld bytes from offset 0x%llx on file %d, rc = %ld\n", sizeof(CELL), (long long)trie_index*sizeof(CELL), trie_fd, rc); exit(1);
-      exit(1);
-    }
-    this = &tmp;
+  if (trie_index & TAIL_EDGE) {
+    print_match(read_tail(trie_index & ~TAIL_EDGE, NULL));
+    return;
   }
+  fetch_trie_cell(trie_index, &tmp, TRUE);
+  this = &tmp;
 
   for (e = _A_; e <= _N_; e++) {
     edge = this->edge[e]&EDGE_MASK;
@@ -146,28 +323,40 @@ void print_remaining_trie(INDEX trie_index, int trie_fd, int index_fd, int offse
   //fprintf(stderr, "< print_remaining_trie(%lld)\n", trie_index);
 }
 
-static CELL *fetch_trie_cell(INDEX idx) {
-  static CELL tmp; // NOT THREAD SAFE.  Only one call at a time.
-  ssize_t rc;
-
-  //fprintf(stderr, "Fetch: %lld\n", idx);
-  rc = pread(trie_fd, &tmp, sizeof(CELL), idx*sizeof(CELL));
-  if (rc != sizeof(CELL)) {
-    fprintf(stderr, "nearmatch: failed to fetch %d bytes from offset 0x%llx on file %d, rc = %d\n",
-            (int)sizeof(CELL), idx*sizeof(CELL), trie_fd, (int)rc); exit(1);
-    exit(1);
+// Follow the rest of the target down a tail, which is a chain of single-child nodes
+// with no N edges, so only the literal match or a substitution can apply at each base.
+void lookup_tail(INDEX tail_index, char *s, int actual_errors, int allowed_errors)
+{
+  char tail[256];
+  EDGE read = read_tail(tail_index, tail);
+  int i;
+
+  for (i = 0; tail[i] != '\0'; i++) {
+    if (s[i] == '\0') break; // target is a prefix of this read
+    if ((s[i] != tail[i]) && (s[i] != 'N')) {
+      if (actual_errors >= allowed_errors) return;
+      actual_errors++;
+    }
   }
-  return &tmp;
+  if ((tail[i] == '\0') && (s[i] != '\0') && (s[i-1] == tail[i-1])) {
+    fprintf(stderr, "warning: target string is longer than the reads in this database - ignoringing the excess at the end: %s\n", s+i);
+  }
+  print_match(read);
 }
 
 void lookup_read(INDEX trie_index, char *s, int actual_errors, int allowed_errors)
 {
   int c;
   INDEX edge;
-  CELL *this;
+  CELL tmp, *this;
   //fprintf(stderr, "> lookup_read(%lld, \"%s\")\n", trie_index, s);
 
-  this = ((trie_cell && (trie_index <= last_used_edge)) ? &trie_cell[trie_index] : fetch_trie_cell(trie_index));
+  if (trie_index & TAIL_EDGE) {
+    lookup_tail(trie_index & ~TAIL_EDGE, s, actual_errors, allowed_errors);
+    return;
+  }
+  fetch_trie_cell(trie_index, &tmp, TRUE);
+  this = &tmp;
 
   c = *s;
 
@@ -205,7 +394,6 @@ void lookup_read(INDEX trie_index, char *s, int actual_errors, int allowed_error
     } else {
       //fprintf(stderr, "3: lookup_read(%lld, \"%s\") this=%p\n", edge, s+1, this);
       lookup_read(edge, s+1, actual_errors, allowed_errors); // Matching an 'N' doesn't count against allowed errors
-      this = ((trie_cell && (trie_index <= last_used_edge)) ? &trie_cell[trie_index] : fetch_trie_cell(trie_index)); // Restore
     }
   }
 
@@ -219,7 +407,6 @@ void lookup_read(INDEX trie_index, char *s, int actual_errors, int allowed_error
       } else {
         //fprintf(stderr, "2: lookup_read(%lld, \"%s\")\n", edge, s+1);
         lookup_read(edge, s+1, actual_errors, allowed_errors); // Matching an 'N' doesn't count against allowed errors
-        this = ((trie_cell && (trie_index <= last_used_edge)) ? &trie_cell[trie_index] : fetch_trie_cell(trie_index)); // Restore
       }
     }
 
@@ -234,7 +421,6 @@ void lookup_read(INDEX trie_index, char *s, int actual_errors, int allowed_error
           } else {
 	    //fprintf(stderr, "1: lookup_read(%lld, \"%s\")\n", edge, s+1);
             lookup_read(edge, s+1, actual_errors+1, allowed_errors); // Matching an 'N' doesn't count against allowed errors
-            this = ((trie_cell && (trie_index <= last_used_edge)) ? &trie_cell[trie_index] : fetch_trie_cell(trie_index)); // Restore
           }
         }
       }
@@ -251,7 +437,6 @@ void lookup_read(INDEX trie_index, char *s, int actual_errors, int allowed_error
         } else {
 	  //fprintf(stderr, "1: lookup_read(%lld, \"%s\")\n", edge, s+1);
           lookup_read(edge, s+1, actual_errors, allowed_errors); // Matching an 'N' doesn't count against allowed errors
-          this = ((trie_cell && (trie_index <= last_used_edge)) ? &trie_cell[trie_index] : fetch_trie_cell(trie_index)); // Restore
         }
       }
     }
@@ -271,11 +456,14 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  read_file = fopen(argv[1], "r");
+  read_fd = open(argv[1], O_RDONLY);
+  read_file = (read_fd < 0) ? NULL : gzdopen(dup(read_fd), "r");
   if (read_file == NULL) {
     fprintf(stderr, "nearmatch: cannot access fastq file %s - %s\n", argv[1], strerror(errno));
     exit(EXIT_FAILURE);
   }
+  bgzf = is_bgzf(read_fd);
+  if (!bgzf && !gzdirect(read_file)) load_read_text();
 
   sprintf(trie_file_name, "%s-edges", argv[1]);
   trie_fd = open(trie_file_name, O_RDONLY);
@@ -291,13 +479,15 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  file_length = lseek(trie_fd, (off_t)0LL, SEEK_END);
-  //fprintf(stderr, "trie: %lld entries\n", (long long)file_length/sizeof(CELL)-1LL);
-  trie_cell = mmap(NULL, (size_t)file_length, PROT_READ, MAP_PRIVATE/*SHARED*/, trie_fd, (off_t)0LL);
-  if ((trie_cell == NULL) || (trie_cell == (void *)-1)) {
+  read_trie_header(trie_fd);
+  sprintf(nedge_file_name, "%s-nedges", argv[1]);
+  load_nedges(nedge_file_name);
+  trie_length = file_length = lseek(trie_fd, (off_t)0LL, SEEK_END);
+  //fprintf(stderr, "trie: %lld entries\n", (long long)file_length/cell_bytes-1LL);
+  trie_bytes = mmap(NULL, (size_t)file_length, PROT_READ, MAP_PRIVATE/*SHARED*/, trie_fd, (off_t)0LL);
+  if ((trie_bytes == NULL) || (trie_bytes == (void *)-1)) {
     //fprintf(stderr, "nearmatch: failed to map %s - %s - so using direct access instead\n", trie_file_name, strerror(errno));
-    trie_cell = NULL; 
-    last_used_edge = -1; // force all accesses via disk.
+    trie_bytes = NULL; // force all accesses via disk.
     // later can load as much as possible into ram, thuis caching the majority of accesses.
   }
 
@@ -0,0 +1,416 @@
+// relayout: renumber the cells of a trie built by maketrie so that the top of the
+// trie is in one contiguous block at the start of the -edges file.
+//
+// maketrie numbers cells in the order the reads arrive, so the first few levels of
+// the trie - which every lookup passes through, and where most overlap probes fail -
+// end up scattered over the whole file and, when findoverlaps splits the file into
+// one chunk per rank, over every rank.  This rewrites <input>-edges (and -nedges)
+// with the cells in one of two orders:
+//
+//   -band      (default) breadth-first for as many whole levels as fit in the first
+//              chunk, then each subtree below that depth-first, so a probe that gets
+//              past the top band stays inside one subtree.  A subtree that would just
+//              spill over a chunk boundary is started on the next chunk instead.
+//   -band=D    the same, with levels 0..D breadth-first.
+//   -bfs       breadth-first throughout.
+//
+// -chunk=CELLS should be the chunk size findoverlaps allocates on each rank (it
+// reports "allocated N-item long array"); the default suits the single-machine
+// tools, keeping the hot top of the trie in the first 1M cells.  A node is kept in
+// the same chunk as its tails where it can be, though findoverlaps will follow a
+// tail onto the next rank if it has to.
+//
+// Unreachable cells (holes left by ranks that leased space, slab cells lost to
+// races in the threaded build) are dropped.  Read numbers, and so -index and
+// -sorted, are unchanged.  Any <input>-links from suffixlinks no longer fits the new
+// numbering and is removed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+
+typedef unsigned long long EDGE;
+typedef unsigned long long INDEX;
+
+#define ENDS_WORD (1ULL<<63ULL)
+#define EDGE_MASK (ENDS_WORD-1ULL)
+#define TAIL_EDGE (1ULL<<62ULL) // with 'tails' set, points at the packed rest of a single read
+
+#define ROOT_CELL ((INDEX)1L)
+#define _N_ 4
+
+#define MAX_LINE 1024
+
+#ifndef FALSE
+#define TRUE (0==0)
+#define FALSE (0!=0)
+#endif
+
+#define TRIE_MAGIC "TRIE"
+static int edge_bytes = sizeof(EDGE), edge_ways = 5, cell_bytes = 5*sizeof(EDGE);
+static int tails;
+static unsigned char *trie_bytes; // the mmap'd -edges file
+static INDEX cells;               // in the input file, including the header cell 0
+static unsigned long long *nedges; // (parent, child) pairs, sorted by parent
+static long nedge_count;
+
+static INDEX *new_index;          // old cell -> new cell, 0 if not reached
+static INDEX *order;              // new cell -> old cell, 0 for padding
+static INDEX placed = ROOT_CELL, order_size;
+static INDEX chunk = 1ULL<<20ULL, padding;
+
+static void read_trie_header(void)
+{
+  if ((cells > 0) && (memcmp(trie_bytes, TRIE_MAGIC, 4) == 0)) {
+    edge_bytes = trie_bytes[4];
+    edge_ways = trie_bytes[5];
+    tails = trie_bytes[6];
+    if (((edge_ways != 4) && (edge_ways != 5)) || ((edge_bytes != 4) && (edge_bytes != 5) && (edge_bytes != 8)) || (tails > 1)) {
+      fprintf(stderr, "relayout: unsupported trie format (%d-byte edges, %d per cell)\n", edge_bytes, edge_ways);
+      exit(EXIT_FAILURE);
+    }
+    cell_bytes = edge_bytes*edge_ways;
+  }
+}
+
+static void load_nedges(char *filename)
+{
+  FILE *f;
+  long bytes;
+
+  f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "relayout: cannot access N edge file %s - %s\n", filename, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fseek(f, 0L, SEEK_END); bytes = ftell(f); fseek(f, 0L, SEEK_SET);
+  nedge_count = bytes / (2*sizeof(unsigned long long));
+  nedges = malloc(nedge_count*2*sizeof(unsigned long long) + 1);
+  if ((nedges == NULL) || (fread(nedges, 2*sizeof(unsigned long long), nedge_count, f) != (size_t)nedge_count)) {
+    fprintf(stderr, "relayout: cannot load N edge file %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+}
+
+static int nedge_compare(const void *a, const void *b)
+{
+  unsigned long long pa = *(const unsigned long long *)a, pb = *(const unsigned long long *)b;
+
+  return (pa < pb) ? -1 : (pa > pb);
+}
+
+static EDGE nedge_lookup(INDEX idx)
+{
+  long lo = 0, hi = nedge_count-1, mid;
+
+  while (lo <= hi) {
+    mid = (lo+hi)/2;
+    if (nedges[mid*2] == (unsigned long long)idx) return nedges[mid*2+1];
+    if (nedges[mid*2] < (unsigned long long)idx) lo = mid+1; else hi = mid-1;
+  }
+  return 0LL;
+}
+
+// Edges are packed little-endian; in the compact widths the top bit is ENDS_WORD and
+// the next one down marks a tail.
+static EDGE get_edge(unsigned char *p, int i)
+{
+  EDGE e = 0LL;
+  int b;
+
+  for (b = edge_bytes-1; b >= 0; b--) e = (e << 8) | p[i*edge_bytes+b];
+  if (edge_bytes == 8) return e;
+  if (e >> (edge_bytes*8-1)) return ENDS_WORD | (e & ((1ULL << (edge_bytes*8-1))-1ULL));
+  if (tails && (e >> (edge_bytes*8-2))) return TAIL_EDGE | (e & ((1ULL << (edge_bytes*8-2))-1ULL));
+  return e;
+}
+
+static void put_edge(unsigned char *p, int i, EDGE e)
+{
+  int b;
+
+  if (edge_bytes != 8) {
+    if (e & ENDS_WORD) e = (1ULL << (edge_bytes*8-1)) | (e & EDGE_MASK);
+    else if (e & TAIL_EDGE) e = (1ULL << (edge_bytes*8-2)) | (e & ~TAIL_EDGE);
+  }
+  for (b = 0; b < edge_bytes; b++) {
+    p[i*edge_bytes+b] = e & 0xFF;
+    e >>= 8;
+  }
+}
+
+static void get_children(INDEX idx, EDGE *child)
+{
+  int i;
+
+  if ((idx == 0) || (idx >= cells)) {
+    fprintf(stderr, "relayout: edge to cell %lld is outside the trie (%lld cells)\n", idx, cells);
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < edge_ways; i++) child[i] = get_edge(trie_bytes + idx*cell_bytes, i);
+  child[_N_] = (edge_ways == 4) ? nedge_lookup(idx) : child[_N_];
+}
+
+#define IS_NODE(e) (((e) != 0LL) && !((e) & (ENDS_WORD|TAIL_EDGE)))
+#define IS_TAIL(e) (((e) & (ENDS_WORD|TAIL_EDGE)) == TAIL_EDGE)
+
+// A node is placed together with its tail cells, which must stay on the same rank.
+static int unit_size(EDGE *child)
+{
+  int i, unit = 1;
+
+  for (i = 0; i < 5; i++) if (IS_TAIL(child[i])) unit++;
+  return unit;
+}
+
+static void put_order(INDEX old)
+{
+  if (placed >= order_size) {
+    order_size = order_size*2 + 1024;
+    order = realloc(order, order_size*sizeof(INDEX));
+    if (order == NULL) {
+      fprintf(stderr, "relayout: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  order[placed++] = old;
+  if (old != 0) new_index[old] = placed-1;
+}
+
+static void pad_to(INDEX boundary)
+{
+  while ((placed % boundary) != 0) {
+    put_order(0);
+    padding++;
+  }
+}
+
+static void place(INDEX idx)
+{
+  EDGE child[5];
+  int i, unit;
+
+  get_children(idx, child);
+  unit = unit_size(child);
+  if ((placed % chunk) + unit > chunk) pad_to(chunk);
+  put_order(idx);
+  for (i = 0; i < 5; i++) if (IS_TAIL(child[i])) put_order(child[i] & ~TAIL_EDGE);
+}
+
+static INDEX *stack;
+static long stack_size;
+
+static void push(long *sp, INDEX idx)
+{
+  if (*sp >= stack_size) {
+    stack_size = stack_size*2 + 1024;
+    stack = realloc(stack, stack_size*sizeof(INDEX));
+    if (stack == NULL) {
+      fprintf(stderr, "relayout: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  stack[(*sp)++] = idx;
+}
+
+// Depth-first, either counting the cells below root or placing them.
+static INDEX walk_subtree(INDEX root, int do_place)
+{
+  EDGE child[5];
+  INDEX size = 0;
+  long sp = 0;
+  int i;
+
+  push(&sp, root);
+  while (sp > 0) {
+    INDEX idx = stack[--sp];
+
+    if (do_place) place(idx);
+    get_children(idx, child);
+    size += unit_size(child);
+    for (i = 4; i >= 0; i--) if (IS_NODE(child[i])) push(&sp, child[i]);
+  }
+  return size;
+}
+
+int main(int argc, char **argv)
+{
+  char trie_file_name[MAX_LINE], nedge_file_name[MAX_LINE], new_file_name[MAX_LINE];
+  char new_nedge_file_name[MAX_LINE], link_file_name[MAX_LINE];
+  int band = -1, bfs = FALSE, depth, i;
+  INDEX level_start, level_end, k, reached;
+  unsigned char *cell;
+  off_t file_length;
+  FILE *out;
+  int fd;
+
+  while ((argc > 1) && (argv[1][0] == '-')) {
+    if (strcmp(argv[1], "-bfs") == 0) bfs = TRUE;
+    else if (strcmp(argv[1], "-band") == 0) band = -1;
+    else if (strncmp(argv[1], "-band=", 6) == 0) band = atoi(argv[1]+6);
+    else if (strncmp(argv[1], "-chunk=", 7) == 0) chunk = atoll(argv[1]+7);
+    else {
+      fprintf(stderr, "relayout: unknown option %s\n", argv[1]);
+      exit(EXIT_FAILURE);
+    }
+    argc--; argv++;
+  }
+  if ((argc != 2) || (chunk < 16)) {
+    fprintf(stderr, "syntax: relayout [-bfs | -band[=depth]] [-chunk=cells] input.fastq\n");
+    exit(EXIT_FAILURE);
+  }
+
+  sprintf(trie_file_name, "%s-edges", argv[1]);
+  fd = open(trie_file_name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "relayout: cannot access trie file %s - %s\n", trie_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  file_length = lseek(fd, (off_t)0LL, SEEK_END);
+  trie_bytes = mmap(NULL, (size_t)file_length, PROT_READ, MAP_PRIVATE, fd, (off_t)0LL);
+  if (trie_bytes == (void *)-1) {
+    fprintf(stderr, "relayout: cannot map %s - %s\n", trie_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  cells = (file_length >= 8) ? 1 : 0;
+  read_trie_header();
+  cells = file_length/cell_bytes;
+  if (cells <= ROOT_CELL) {
+    fprintf(stderr, "relayout: %s is empty\n", trie_file_name);
+    exit(EXIT_FAILURE);
+  }
+  sprintf(nedge_file_name, "%s-nedges", argv[1]);
+  if (edge_ways == 4) load_nedges(nedge_file_name);
+
+  new_index = calloc(cells, sizeof(INDEX));
+  if (new_index == NULL) {
+    fprintf(stderr, "relayout: out of memory for %lld cells\n", cells);
+    exit(EXIT_FAILURE);
+  }
+  put_order(0); placed = ROOT_CELL; // cell 0 holds the header
+
+  // Breadth-first, one level at a time, using the new order itself as the queue.
+  place(ROOT_CELL);
+  level_start = ROOT_CELL; level_end = placed;
+  for (depth = 0; level_start < level_end; depth++) {
+    INDEX next_level = 0;
+    EDGE child[5];
+
+    if (!bfs && (band >= 0) && (depth >= band)) break;
+    if (!bfs && (band < 0)) { // stop when the next level would not fit in the first chunk
+      for (k = level_start; k < level_end; k++) {
+        if (order[k] == 0) continue;
+        get_children(order[k], child);
+        for (i = 0; i < 5; i++) if (IS_NODE(child[i])) {
+          EDGE grandchild[5];
+          get_children(child[i], grandchild);
+          next_level += unit_size(grandchild);
+        }
+      }
+      if (placed + next_level > chunk) break;
+    }
+    for (k = level_start; k < level_end; k++) {
+      if (order[k] == 0) continue; // padding; tail cells have no node children
+      get_children(order[k], child);
+      for (i = 0; i < 5; i++) if (IS_NODE(child[i])) place(child[i]);
+    }
+    level_start = level_end; level_end = placed;
+  }
+  if (level_start < level_end) {
+    fprintf(stderr, "relayout: levels 0..%d (%lld cells) breadth-first, the rest depth-first\n", depth, level_end-ROOT_CELL);
+  } else {
+    fprintf(stderr, "relayout: all %d levels breadth-first\n", depth);
+  }
+
+  // Then each subtree hanging off the last breadth-first level, depth-first.  One that
+  // fits in a chunk but not in what is left of this one starts a new chunk, as long as
+  // that wastes no more than 1/16 of a chunk.
+  for (k = level_start; k < level_end; k++) {
+    EDGE child[5];
+
+    if (order[k] == 0) continue;
+    get_children(order[k], child);
+    for (i = 0; i < 5; i++) if (IS_NODE(child[i])) {
+      INDEX size = walk_subtree(child[i], FALSE), room = chunk - (placed % chunk);
+
+      if ((size > room) && (size <= chunk) && (room <= chunk/16)) pad_to(chunk);
+      (void)walk_subtree(child[i], TRUE);
+    }
+  }
+
+  if ((edge_bytes != 8) && (placed-1 > ((1ULL << (edge_bytes*8-1-tails))-1ULL))) {
+    fprintf(stderr, "relayout: %lld cells will not fit in %d-byte edges\n", placed, edge_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  sprintf(new_file_name, "%s-edges.relayout", argv[1]);
+  out = fopen(new_file_name, "wb");
+  cell = calloc(1, cell_bytes);
+  if ((out == NULL) || (cell == NULL)) {
+    fprintf(stderr, "relayout: cannot write %s - %s\n", new_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fwrite(trie_bytes, cell_bytes, 1, out); // the header, unchanged
+  reached = 0;
+  for (k = ROOT_CELL; k < placed; k++) {
+    memset(cell, 0, cell_bytes);
+    if (order[k] != 0) {
+      memcpy(cell, trie_bytes + order[k]*cell_bytes, cell_bytes);
+      for (i = 0; i < edge_ways; i++) { // tail cells only hold leaf-like words, left as they are
+        EDGE e = get_edge(cell, i);
+        if (IS_NODE(e)) put_edge(cell, i, new_index[e]);
+        else if (IS_TAIL(e)) put_edge(cell, i, TAIL_EDGE | new_index[e & ~TAIL_EDGE]);
+      }
+      reached++;
+    }
+    fwrite(cell, cell_bytes, 1, out);
+  }
+  if (ferror(out) || (fclose(out) == EOF)) {
+    fprintf(stderr, "relayout: error writing %s - %s\n", new_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (edge_ways == 4) {
+    long n;
+
+    for (n = 0; n < nedge_count; n++) {
+      EDGE e = nedges[n*2+1];
+      nedges[n*2] = new_index[nedges[n*2]];
+      if (IS_NODE(e)) nedges[n*2+1] = new_index[e];
+      else if (IS_TAIL(e)) nedges[n*2+1] = TAIL_EDGE | new_index[e & ~TAIL_EDGE];
+    }
+    qsort(nedges, nedge_count, 2*sizeof(unsigned long long), nedge_compare); // the new numbering is not monotonic
+    sprintf(new_nedge_file_name, "%s-nedges.relayout", argv[1]);
+    out = fopen(new_nedge_file_name, "wb");
+    if ((out == NULL) || (fwrite(nedges, 2*sizeof(unsigned long long), nedge_count, out) != (size_t)nedge_count)
+        || (fclose(out) == EOF)) {
+      fprintf(stderr, "relayout: error writing %s - %s\n", new_nedge_file_name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Only now that both new files are complete is either old one replaced.
+  if ((edge_ways == 4) && (rename(new_nedge_file_name, nedge_file_name) != 0)) {
+    fprintf(stderr, "relayout: cannot replace %s - %s\n", nedge_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (rename(new_file_name, trie_file_name) != 0) {
+    fprintf(stderr, "relayout: cannot replace %s - %s\n", trie_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  sprintf(link_file_name, "%s-links", argv[1]);
+  if ((unlink(link_file_name) != 0) && (errno != ENOENT)) {
+    fprintf(stderr, "relayout: cannot remove %s - %s\n", link_file_name, strerror(errno));
+  }
+  fprintf(stderr, "relayout: %lld cells in, %lld reachable, %lld padding; %s now has %lld cells\n",
+          cells-1, reached, padding, trie_file_name, placed-1);
+  exit(EXIT_SUCCESS);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,241 @@
+// suffixlinks: run after maketrie (and after relayout, if you use it) to give every
+// node of the trie a link to the node for the longest proper suffix of its string
+// that is also in the trie - the failure links of an Aho-Corasick automaton.
+//
+// findoverlaps looks for every suffix of each read that is a prefix of other reads.
+// Without links it walks the trie from the root once per suffix, which costs
+// O(L^2) node visits for a read of length L.  With them it feeds the read through
+// the trie once, falling back along the links on a mismatch, and then follows the
+// links from where it ended up: that chain visits exactly the suffixes of the read
+// which are paths in the trie, longest first, so a read costs O(L) plus its output.
+//
+// The links are written to <input>-links, one 64-bit word per cell of -edges: the
+// depth of the node in the top 16 bits and the cell its link points to in the rest.
+// Word 0 holds LINK_MAGIC and, in its top 32 bits, an identity of the -edges file
+// the links were made from.  Read-end and tail cells get no link; the full-length
+// read itself is never a suffix we want, so the automaton stops one base short.
+// Tries built with TAILS=1 are refused - most suffixes end part way through a tail
+// cell and so have no node to link to.
+//
+// findoverlaps uses -links only if that identity still matches -edges, so rerunning
+// maketrie or relayout without rerunning this just loses the speedup.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+
+typedef unsigned long long EDGE;
+typedef unsigned long long INDEX;
+
+#define ENDS_WORD (1ULL<<63ULL)
+#define EDGE_MASK (ENDS_WORD-1ULL)
+#define TAIL_EDGE (1ULL<<62ULL)
+
+#define ROOT_CELL ((INDEX)1L)
+#define _N_ 4
+
+#define MAX_LINE 1024
+
+#define LINK_MAGIC "LINK"
+#define LINK_DEPTH_SHIFT 48
+#define LINK_CELL_MASK ((1ULL<<LINK_DEPTH_SHIFT)-1ULL)
+#define LINK_ID_BYTES 4096 // of -edges: the header and the cells nearest the root
+
+#define TRIE_MAGIC "TRIE"
+static int edge_bytes = sizeof(EDGE), edge_ways = 5, cell_bytes = 5*sizeof(EDGE);
+static int tails;
+static unsigned char *trie_bytes; // the mmap'd -edges file
+static INDEX cells;               // in the input file, including the header cell 0
+static unsigned long long *nedges; // (parent, child) pairs, sorted by parent
+static long nedge_count;
+
+static INDEX *link_word;          // the -links file we are building
+static INDEX *queue;              // breadth-first order of the nodes
+
+static void read_trie_header(void)
+{
+  if ((cells > 0) && (memcmp(trie_bytes, TRIE_MAGIC, 4) == 0)) {
+    edge_bytes = trie_bytes[4];
+    edge_ways = trie_bytes[5];
+    tails = trie_bytes[6];
+    if (((edge_ways != 4) && (edge_ways != 5)) || ((edge_bytes != 4) && (edge_bytes != 5) && (edge_bytes != 8)) || (tails > 1)) {
+      fprintf(stderr, "suffixlinks: unsupported trie format (%d-byte edges, %d per cell)\n", edge_bytes, edge_ways);
+      exit(EXIT_FAILURE);
+    }
+    cell_bytes = edge_bytes*edge_ways;
+  }
+}
+
+static void load_nedges(char *filename)
+{
+  FILE *f;
+  long bytes;
+
+  f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "suffixlinks: cannot access N edge file %s - %s\n", filename, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fseek(f, 0L, SEEK_END); bytes = ftell(f); fseek(f, 0L, SEEK_SET);
+  nedge_count = bytes / (2*sizeof(unsigned long long));
+  nedges = malloc(nedge_count*2*sizeof(unsigned long long) + 1);
+  if ((nedges == NULL) || (fread(nedges, 2*sizeof(unsigned long long), nedge_count, f) != (size_t)nedge_count)) {
+    fprintf(stderr, "suffixlinks: cannot load N edge file %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+}
+
+static EDGE nedge_lookup(INDEX idx)
+{
+  long lo = 0, hi = nedge_count-1, mid;
+
+  while (lo <= hi) {
+    mid = (lo+hi)/2;
+    if (nedges[mid*2] == (unsigned long long)idx) return nedges[mid*2+1];
+    if (nedges[mid*2] < (unsigned long long)idx) lo = mid+1; else hi = mid-1;
+  }
+  return 0LL;
+}
+
+// Edges are packed little-endian; in the compact widths the top bit is ENDS_WORD.
+static EDGE get_child(INDEX idx, int c)
+{
+  unsigned char *p = trie_bytes + idx*cell_bytes + c*edge_bytes;
+  EDGE e = 0LL;
+  int b;
+
+  if (c >= edge_ways) return nedge_lookup(idx);
+  for (b = edge_bytes-1; b >= 0; b--) e = (e << 8) | p[b];
+  if (edge_bytes == 8) return e;
+  if (e >> (edge_bytes*8-1)) return ENDS_WORD | (e & ((1ULL << (edge_bytes*8-1))-1ULL));
+  return e;
+}
+
+#define IS_NODE(e) (((e) != 0LL) && !((e) & (ENDS_WORD|TAIL_EDGE)))
+
+// The identity of an -edges file: an FNV-1a hash of its size, its modification time
+// to the nanosecond and its first LINK_ID_BYTES, folded to 32 bits.  findoverlaps
+// computes the same thing.
+static unsigned int edges_identity(int fd)
+{
+  unsigned char buf[LINK_ID_BYTES];
+  unsigned long long h = 14695981039346656037ULL, v[3];
+  struct stat st;
+  ssize_t n, i;
+
+  if (fstat(fd, &st) != 0) return 0;
+  v[0] = st.st_size; v[1] = st.st_mtim.tv_sec; v[2] = st.st_mtim.tv_nsec;
+  n = pread(fd, buf, sizeof(buf), (off_t)0);
+  for (i = 0; i < (ssize_t)sizeof(v); i++) h = (h ^ ((unsigned char *)v)[i]) * 1099511628211ULL;
+  for (i = 0; i < n; i++) h = (h ^ buf[i]) * 1099511628211ULL;
+  return (unsigned int)(h ^ (h >> 32));
+}
+
+int main(int argc, char **argv)
+{
+  char trie_file_name[MAX_LINE], nedge_file_name[MAX_LINE], link_file_name[MAX_LINE];
+  INDEX head = 0, tail = 0, links = 0, longest = 0;
+  off_t file_length;
+  FILE *out;
+  unsigned int identity;
+  int fd, c;
+
+  if (argc != 2) {
+    fprintf(stderr, "syntax: suffixlinks input.fastq\n");
+    exit(EXIT_FAILURE);
+  }
+
+  sprintf(trie_file_name, "%s-edges", argv[1]);
+  fd = open(trie_file_name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "suffixlinks: cannot access trie file %s - %s\n", trie_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  file_length = lseek(fd, (off_t)0LL, SEEK_END);
+  trie_bytes = mmap(NULL, (size_t)file_length, PROT_READ, MAP_PRIVATE, fd, (off_t)0LL);
+  if (trie_bytes == (void *)-1) {
+    fprintf(stderr, "suffixlinks: cannot map %s - %s\n", trie_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  cells = (file_length >= 8) ? 1 : 0;
+  read_trie_header();
+  cells = file_length/cell_bytes;
+  if (cells <= ROOT_CELL) {
+    fprintf(stderr, "suffixlinks: %s is empty\n", trie_file_name);
+    exit(EXIT_FAILURE);
+  }
+  if (tails) {
+    fprintf(stderr, "suffixlinks: %s was built with TAILS=1, which suffix links cannot be used with\n",
+            trie_file_name);
+    exit(EXIT_FAILURE);
+  }
+  if (cells > LINK_CELL_MASK) {
+    fprintf(stderr, "suffixlinks: %lld cells is too many to link\n", cells);
+    exit(EXIT_FAILURE);
+  }
+  sprintf(nedge_file_name, "%s-nedges", argv[1]);
+  if (edge_ways == 4) load_nedges(nedge_file_name);
+
+  link_word = calloc(cells, sizeof(INDEX));
+  queue = malloc(cells*sizeof(INDEX));
+  if ((link_word == NULL) || (queue == NULL)) {
+    fprintf(stderr, "suffixlinks: out of memory for %lld cells\n", cells);
+    exit(EXIT_FAILURE);
+  }
+
+  // Breadth-first, so that a node's link, and every link below it on the way
+  // back to the root, is known before its children need them.
+  link_word[ROOT_CELL] = ROOT_CELL;
+  queue[tail++] = ROOT_CELL;
+  while (head < tail) {
+    INDEX parent = queue[head++];
+    INDEX depth = (link_word[parent] >> LINK_DEPTH_SHIFT) + 1;
+
+    for (c = 0; c <= _N_; c++) {
+      EDGE child = get_child(parent, c), target;
+      INDEX fall = parent;
+
+      if (!IS_NODE(child)) continue;
+      if ((child >= cells) || (link_word[child] != 0)) {
+        fprintf(stderr, "suffixlinks: edge to cell %lld from cell %lld is outside the trie or shared\n",
+                child, parent);
+        exit(EXIT_FAILURE);
+      }
+      // The longest suffix of parent's string that can be extended by c, extended by c.
+      target = ROOT_CELL;
+      while (fall != ROOT_CELL) {
+        fall = link_word[fall] & LINK_CELL_MASK;
+        target = get_child(fall, c);
+        if (IS_NODE(target)) break;
+        target = ROOT_CELL;
+      }
+      link_word[child] = (depth << LINK_DEPTH_SHIFT) | target;
+      if (target != ROOT_CELL) links++;
+      if (depth > longest) longest = depth;
+      queue[tail++] = child;
+    }
+  }
+  link_word[ROOT_CELL] = ROOT_CELL; // depth 0, links to itself
+  memcpy(link_word, LINK_MAGIC, 4);
+  identity = edges_identity(fd);
+  memcpy((char *)link_word + 4, &identity, 4);
+
+  sprintf(link_file_name, "%s-links", argv[1]);
+  out = fopen(link_file_name, "wb");
+  if ((out == NULL) || (fwrite(link_word, sizeof(INDEX), cells, out) != (size_t)cells)
+      || (fclose(out) == EOF)) {
+    fprintf(stderr, "suffixlinks: error writing %s - %s\n", link_file_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "suffixlinks: %lld nodes up to depth %lld, %lld linked below the root; wrote %s\n",
+          tail, longest, links, link_file_name);
+  exit(EXIT_SUCCESS);
+  return EXIT_FAILURE;
+}